@@ -824,6 +824,10 @@ void adsPlay(char *adsName, uint16 adsTag)
     grRestoreZone(NULL, 0, 0, 0, 0);
 
     adsReleaseAds();
+
+    // What the first scene loaded is worth keeping for the next runs:
+    // the cache is saved now, a screensaver seldom exits normally
+    saveResourcesCache();
 }
 
 
@@ -868,6 +872,47 @@ void adsPlayBench(void)  // TODO - tempo
         printf(" %d-layers test --> %d fps\n", numLayers, counter/3);
     }
 
+    // How composing the whole screen scales with the number of threads
+    int composeWorkers = grComposeWorkers;
+    int maxWorkers = (composeWorkers > 0 ? composeWorkers : platformGetCPUCount());
+
+    for (int i=0; i < MAX_TTM_THREADS; i++)
+        ttmThreads[i].isRunning = (i<8 ? 1 : 0);
+
+    for (int numWorkers=1; numWorkers <= maxWorkers; numWorkers++) {
+
+        grSetComposeWorkers(numWorkers);
+
+        startTicks = platformGetTicks();
+        counter = 0;
+
+        while ((platformGetTicks() - startTicks) <= 1000) {
+
+            for (int i=0; i < 8; i++)
+                benchPlay(&ttmThreads[i], i);
+
+            grDamageAll();
+            grUpdateDisplay(NULL, ttmThreads, NULL, NULL);
+
+            counter++;
+        }
+
+        printf(" %d-threads compose test --> %d fps\n", numWorkers, counter);
+    }
+
+    grSetComposeWorkers(composeWorkers);
+
+    // Against the cost of presenting the frame, which is not split
+    startTicks = platformGetTicks();
+    counter = 0;
+
+    while ((platformGetTicks() - startTicks) <= 1000) {
+        grRefreshDisplay();
+        counter++;
+    }
+
+    printf(" present test --> %d fps\n", counter);
+
     for (int i=0; i < 8; i++)
         adsStopScene(i);
 
@@ -919,10 +964,8 @@ void adsInitIsland(void)
     ttmCloudsThread.isRunning = 3;
     ttmCloudsThread.delay     = 8;
     ttmCloudsThread.timer     = 0;
-    if (ttmCloudsThread.ttmLayer) {
-        ttmCloudsThread.ttmLayer = NULL;
+    if (ttmCloudsThread.ttmLayer != NULL)
         grFreeLayer(ttmCloudsThread.ttmLayer);
-    }
     ttmCloudsThread.ttmLayer  = grNewLayer();
 
     islandAnimateClouds(&ttmCloudsThread);
@@ -937,12 +980,18 @@ void adsReleaseIsland(void)
     if (ttmHolidayThread.isRunning) {
         ttmHolidayThread.isRunning = 0;
         grFreeLayer(ttmHolidayThread.ttmLayer);
+        ttmHolidayThread.ttmLayer = NULL;
     }
 
-    if (ttmCloudsThread.isRunning) {
-        ttmCloudsThread.isRunning = 0;
+    // Without clouds, the thread stops but keeps its layer
+    ttmCloudsThread.isRunning = 0;
+
+    if (ttmCloudsThread.ttmLayer != NULL) {
         grFreeLayer(ttmCloudsThread.ttmLayer);
+        ttmCloudsThread.ttmLayer = NULL;
     }
+
+    ttmResetSlot(&ttmCloudsSlot);
 }
 
 
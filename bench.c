@@ -21,10 +21,20 @@
  *
  */
 
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
 #include "mytypes.h"
+#include "utils.h"
 #include "graphics.h"
+#include "expand.h"
 #include "bench.h"
 
+#define BENCH_EXPAND_SIZE   (SCREEN_WIDTH * SCREEN_HEIGHT / 2)
+#define BENCH_EXPAND_LOOPS  200
+
 
 void benchInit(struct TTtmSlot *ttmSlot)
 {
@@ -43,3 +53,97 @@ void benchPlay(struct TTtmThread *ttmThread, int threadNo)
     x %= SCREEN_WIDTH;
 }
 
+
+// The 32bpp palette of the original expansion loop, whose first
+// byte of each color is the color number the kernels produce
+static uint8 benchPalette[16][4];
+
+
+static void benchExpandReference(uint8 *inData, uint32 inSize, uint8 colorMap[16], uint8 *outPixels)
+{
+    // The loop grLoadScreen() and grLoadBmp() used to expand the
+    // pixels with, straight to 32bpp
+    uint8 *inPtr  = inData;
+    uint8 *outPtr = outPixels;
+
+    for (int inOffset=0; inOffset < (int) inSize; inOffset++) {
+        memcpy(outPtr, benchPalette[(inPtr[0] & 0xf0) >> 4] , 4); outPtr += 4;
+        memcpy(outPtr, benchPalette[(inPtr[0] & 0x0f)     ] , 4); outPtr += 4;
+        inPtr++;
+    }
+}
+
+
+static int benchExpandMatches(uint8 *outPixels, uint8 *refPixels)
+{
+    for (int i=0; i < BENCH_EXPAND_SIZE * 2; i++)
+        if (outPixels[i] != refPixels[4 * i])
+            return 0;
+
+    return 1;
+}
+
+
+static double benchExpandKernel(void (*expand)(uint8 *, uint32, uint8 [16], uint8 *),
+                                uint8 *inData, uint8 colorMap[16], uint8 *outPixels)
+{
+    clock_t start = clock();
+
+    for (int i=0; i < BENCH_EXPAND_LOOPS; i++)
+        expand(inData, BENCH_EXPAND_SIZE, colorMap, outPixels);
+
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+
+void benchExpand(void)
+{
+    uint8 colorMap[16];
+    uint8 *inData = safe_malloc(BENCH_EXPAND_SIZE);
+    uint8 *refPixels = safe_malloc(BENCH_EXPAND_SIZE * 2 * 4);
+    uint8 *outPixels = safe_malloc(BENCH_EXPAND_SIZE * 2);
+    uint32 features = getCpuFeatures();
+    double refTime;
+
+    srand(0);
+
+    for (int i=0; i < 16; i++) {
+        colorMap[i] = rand() & 0xff;
+        benchPalette[i][0] = colorMap[i];
+        benchPalette[i][1] = rand() & 0xff;
+        benchPalette[i][2] = rand() & 0xff;
+        benchPalette[i][3] = 0;
+    }
+
+    for (int i=0; i < BENCH_EXPAND_SIZE; i++)
+        inData[i] = rand() & 0xff;
+
+    printf(" 4bpp to 8bpp expansion, %dx%d screen x %d:\n",
+           SCREEN_WIDTH, SCREEN_HEIGHT, BENCH_EXPAND_LOOPS);
+
+    refTime = benchExpandKernel(benchExpandReference, inData, colorMap, refPixels);
+    printf("   %-10s %8.1f Mpixels/s  (32bpp)\n", "original",
+           BENCH_EXPAND_SIZE * 2.0 * BENCH_EXPAND_LOOPS / refTime / 1e6);
+
+    for (int k=0; k < numExpandKernels; k++) {
+
+        double time;
+
+        if ((expandKernels[k].cpuFeatures & features) != expandKernels[k].cpuFeatures) {
+            printf("   %-10s not supported by this CPU\n", expandKernels[k].name);
+            continue;
+        }
+
+        memset(outPixels, 0, BENCH_EXPAND_SIZE * 2);
+        time = benchExpandKernel(expandKernels[k].expand, inData, colorMap, outPixels);
+
+        printf("   %-10s %8.1f Mpixels/s  x%.1f%s\n", expandKernels[k].name,
+               BENCH_EXPAND_SIZE * 2.0 * BENCH_EXPAND_LOOPS / time / 1e6,
+               refTime / time,
+               benchExpandMatches(outPixels, refPixels) ? "" : "  MISMATCH");
+    }
+
+    free(outPixels);
+    free(refPixels);
+    free(inData);
+}
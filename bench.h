@@ -23,4 +23,5 @@
 
 void benchInit(struct TTtmSlot *ttmSlot);
 void benchPlay(struct TTtmThread *ttmThreads, int threadNo);
+void benchExpand(void);
 
@@ -0,0 +1,460 @@
+/*
+ *  This file is part of 'Johnny Reborn'
+ *
+ *  An open-source engine for the classic
+ *  'Johnny Castaway' screensaver by Sierra.
+ *
+ *  Copyright (C) 2019 Jeremie GUILLAUME
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mytypes.h"
+#include "utils.h"
+#include "platform.h"
+#include "cache.h"
+
+#define CACHE_MAGIC     "JCCACHE"
+#define CACHE_VERSION   3
+#define CACHE_ALIGN     16
+
+
+// On-disk layout: a header, the data blocks, then numEntries
+// entries sorted by (resName, kind) pointing to the blocks
+struct TCacheHeader {
+    char   magic[8];
+    uint32 version;
+    uint32 numEntries;
+    uint64_t key;
+    uint32 entriesOffset;
+    uint32 unused;
+};
+
+
+struct TCacheEntry {
+    char   resName[16];
+    uint32 kind;
+    uint32 offset;
+    uint32 size;
+    uint32 unused;
+};
+
+
+struct TCacheSaveItem {
+    struct TCacheEntry entry;
+    uint8  *data;       // NULL when already written
+    int    isNew;
+};
+
+
+static char     *cacheFileName = NULL;
+static uint64_t cacheKey = 0;
+static uint8    *cacheData = NULL;
+static uint32   cacheSize = 0;
+static struct TCacheEntry *cacheEntries = NULL;
+static uint32   cacheNumEntries = 0;
+
+// Data added during this run is written to the temporary file at
+// once, only its entries are kept until the cache is saved
+static char     cacheTmpFileName[256];
+static FILE     *cacheTmpFile = NULL;
+static uint32   cacheTmpSize = 0;
+
+static struct TCacheEntry *newEntries = NULL;
+static uint32   numNewEntries = 0;
+static uint32   maxNewEntries = 0;
+static PlatformMutex *newEntriesMutex = NULL;
+
+#ifdef _WIN32
+// Windows refuses to replace a mapped file, and the previous cache
+// stays mapped for as long as the resources read from it are in use:
+// the new one is saved aside, and put in place on exit once the
+// previous one is unmapped - or by the next run, before mapping it
+static char     cacheNewFileName[256];
+static char     *cachePendingFileName = NULL;
+#endif
+
+
+static uint64_t hashData(uint8 *data, uint32 size)
+{
+    // FNV-1a, 64 bits
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (uint32 i=0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+static int compareEntries(const void *a, const void *b)
+{
+    const struct TCacheEntry *entryA = a, *entryB = b;
+    int result = strcmp(entryA->resName, entryB->resName);
+
+    if (result == 0)
+        result = (int) entryA->kind - (int) entryB->kind;
+
+    return result;
+}
+
+
+static int isValidCache(uint8 *data, uint32 size)
+{
+    struct TCacheHeader *header = (struct TCacheHeader *) data;
+    struct TCacheEntry *entries;
+
+    if (size < sizeof(struct TCacheHeader)
+            || memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))
+            || header->version != CACHE_VERSION
+            || header->key != cacheKey)
+        return 0;
+
+    if (header->entriesOffset > size || header->entriesOffset % CACHE_ALIGN
+            || header->numEntries > (size - header->entriesOffset) / sizeof(struct TCacheEntry))
+        return 0;
+
+    entries = (struct TCacheEntry *) (data + header->entriesOffset);
+
+    for (uint32 i=0; i < header->numEntries; i++) {
+        if (entries[i].offset > size || entries[i].size > size - entries[i].offset)
+            return 0;
+        if (memchr(entries[i].resName, 0, sizeof(entries[i].resName)) == NULL)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+#ifdef _WIN32
+static void installNewCache(char *fileName)
+{
+    remove(fileName);
+
+    if (rename(cacheNewFileName, fileName) != 0)
+        debugMsg("Warning: couldn't replace cache file %s", fileName);
+}
+
+
+static void installSavedCache(void)
+{
+    if (cachePendingFileName == NULL)
+        return;
+
+    if (cacheData != NULL) {
+        unmapFile(cacheData, cacheSize);
+        cacheData = NULL;
+        cacheNumEntries = 0;
+    }
+
+    installNewCache(cachePendingFileName);
+    cachePendingFileName = NULL;
+}
+#endif
+
+
+void cacheOpen(char *fileName, uint8 *keyData, uint32 keySize)
+{
+    cacheFileName = fileName;
+    cacheKey = hashData(keyData, keySize);
+    newEntriesMutex = platformCreateMutex();
+
+#ifdef _WIN32
+    FILE *f;
+
+    snprintf(cacheNewFileName, sizeof(cacheNewFileName), "%s.new", fileName);
+
+    // Left by a run which didn't exit normally
+    if ((f = fopen(cacheNewFileName, "rb")) != NULL) {
+        fclose(f);
+        installNewCache(fileName);
+    }
+
+    // Registered first, so run after cacheSave()
+    atexit(installSavedCache);
+#endif
+
+    cacheData = mapFileReadOnly(fileName, &cacheSize);
+
+    if (cacheData != NULL && !isValidCache(cacheData, cacheSize)) {
+        debugMsg("Discarding stale cache file %s", fileName);
+        unmapFile(cacheData, cacheSize);
+        cacheData = NULL;
+    }
+
+    if (cacheData != NULL) {
+        struct TCacheHeader *header = (struct TCacheHeader *) cacheData;
+
+        cacheEntries = (struct TCacheEntry *) (cacheData + header->entriesOffset);
+        cacheNumEntries = header->numEntries;
+        debugMsg("Using cache file %s (%d entries)", fileName, cacheNumEntries);
+    }
+
+    // Saved at the end of the first scene - or on exit, when
+    // none was played
+    atexit(cacheSave);
+}
+
+
+void *cacheFind(char *resName, int kind, uint32 size)
+{
+    struct TCacheEntry key;
+    struct TCacheEntry *entry;
+
+    if (cacheData == NULL || strlen(resName) >= sizeof(key.resName))
+        return NULL;
+
+    memset(&key, 0, sizeof(key));
+    strcpy(key.resName, resName);
+    key.kind = kind;
+
+    entry = bsearch(&key, cacheEntries, cacheNumEntries,
+                    sizeof(struct TCacheEntry), compareEntries);
+
+    if (entry == NULL || entry->size != size)
+        return NULL;
+
+    return cacheData + entry->offset;
+}
+
+
+int cacheContains(void *ptr)
+{
+    uint8 *p = ptr;
+
+    return cacheData != NULL && p >= cacheData && p < cacheData + cacheSize;
+}
+
+
+static int writeBlock(void *data, uint32 size, uint32 *offset)
+{
+    // Append the data to the temporary file, aligned
+    static const uint8 zeroes[CACHE_ALIGN] = { 0 };
+    uint32 padding = (CACHE_ALIGN - cacheTmpSize % CACHE_ALIGN) % CACHE_ALIGN;
+
+    if (fwrite(zeroes, 1, padding, cacheTmpFile) != padding
+            || fwrite(data, 1, size, cacheTmpFile) != size)
+        return 0;
+
+    *offset = cacheTmpSize + padding;
+    cacheTmpSize += padding + size;
+
+    return 1;
+}
+
+
+static int openTmpFile(void)
+{
+    // Opened on the first addition, the header being written on save.
+    // Writing to a temporary file first, an interrupted run never
+    // leaves a truncated cache behind.
+    struct TCacheHeader header;
+
+    if (cacheTmpFile != NULL)
+        return 1;
+
+    snprintf(cacheTmpFileName, sizeof(cacheTmpFileName), "%s.tmp", cacheFileName);
+
+    cacheTmpFile = fopen(cacheTmpFileName, "wb");
+    memset(&header, 0, sizeof(header));
+
+    if (cacheTmpFile != NULL && fwrite(&header, sizeof(header), 1, cacheTmpFile) == 1) {
+        cacheTmpSize = sizeof(header);
+        return 1;
+    }
+
+    debugMsg("Warning: couldn't open %s for writing", cacheTmpFileName);
+
+    if (cacheTmpFile != NULL) {
+        fclose(cacheTmpFile);
+        remove(cacheTmpFileName);
+        cacheTmpFile = NULL;
+    }
+
+    return 0;
+}
+
+
+static int isNewEntry(struct TCacheEntry *entry)
+{
+    for (uint32 i=0; i < numNewEntries; i++)
+        if (!compareEntries(&newEntries[i], entry))
+            return 1;
+
+    return 0;
+}
+
+
+void cacheAdd(char *resName, int kind, void *data, uint32 size)
+{
+    struct TCacheEntry entry;
+
+    if (newEntriesMutex == NULL || strlen(resName) >= sizeof(entry.resName))
+        return;
+
+    if (cacheFind(resName, kind, size) != NULL)
+        return;
+
+    memset(&entry, 0, sizeof(entry));
+    strcpy(entry.resName, resName);
+    entry.kind = kind;
+    entry.size = size;
+
+    // cacheFileName is cleared by cacheSave(), which the decoding
+    // workers may still race with: it is only read locked
+    platformLockMutex(newEntriesMutex);
+
+    if (cacheFileName == NULL || isNewEntry(&entry)) {
+        platformUnlockMutex(newEntriesMutex);
+        return;
+    }
+
+    // The cache is given up for this run when it can't be written to
+    if (!openTmpFile() || !writeBlock(data, size, &entry.offset)) {
+
+        if (cacheTmpFile != NULL) {
+            debugMsg("Warning: couldn't write %s", cacheTmpFileName);
+            fclose(cacheTmpFile);
+            remove(cacheTmpFileName);
+            cacheTmpFile = NULL;
+        }
+
+        cacheFileName = NULL;
+        platformUnlockMutex(newEntriesMutex);
+        return;
+    }
+
+    if (numNewEntries == maxNewEntries) {
+        maxNewEntries = (maxNewEntries > 0 ? maxNewEntries * 2 : 64);
+        newEntries = safe_realloc(newEntries, maxNewEntries * sizeof(struct TCacheEntry));
+    }
+
+    newEntries[numNewEntries++] = entry;
+    platformUnlockMutex(newEntriesMutex);
+}
+
+
+static int compareSaveItems(const void *a, const void *b)
+{
+    const struct TCacheSaveItem *itemA = a, *itemB = b;
+    int result = compareEntries(&itemA->entry, &itemB->entry);
+
+    // What was added during this run comes first
+    if (result == 0)
+        result = itemB->isNew - itemA->isNew;
+
+    return result;
+}
+
+
+void cacheSave(void)
+{
+    struct TCacheHeader header;
+    struct TCacheSaveItem *items;
+    struct TCacheEntry *entries;
+    uint32 numItems = 0;
+    uint32 numUniqueItems = 0;
+    char *fileName;
+    int ok = 1;
+
+    if (newEntriesMutex == NULL)
+        return;
+
+    // No second save: what is added later is left to the next runs
+    platformLockMutex(newEntriesMutex);
+    fileName = cacheFileName;
+    cacheFileName = NULL;
+    platformUnlockMutex(newEntriesMutex);
+
+    if (fileName == NULL || cacheTmpFile == NULL)
+        return;
+
+    // Merge what the cache already held with what was added: the
+    // latter is in the temporary file already
+    items = safe_malloc((cacheNumEntries + numNewEntries) * sizeof(struct TCacheSaveItem));
+
+    for (uint32 i=0; i < cacheNumEntries; i++) {
+        items[numItems].entry = cacheEntries[i];
+        items[numItems].data  = cacheData + cacheEntries[i].offset;
+        items[numItems++].isNew = 0;
+    }
+
+    for (uint32 i=0; i < numNewEntries; i++) {
+        items[numItems].entry = newEntries[i];
+        items[numItems].data  = NULL;
+        items[numItems++].isNew = 1;
+    }
+
+    // An entry added during this run replaces one of another size
+    qsort(items, numItems, sizeof(struct TCacheSaveItem), compareSaveItems);
+
+    for (uint32 i=0; i < numItems; i++)
+        if (numUniqueItems == 0 || compareEntries(&items[numUniqueItems-1].entry, &items[i].entry))
+            items[numUniqueItems++] = items[i];
+
+    entries = safe_malloc(numUniqueItems * sizeof(struct TCacheEntry));
+
+    for (uint32 i=0; i < numUniqueItems; i++) {
+        if (ok && items[i].data != NULL)
+            ok = writeBlock(items[i].data, items[i].entry.size, &items[i].entry.offset);
+        entries[i] = items[i].entry;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.numEntries = numUniqueItems;
+    header.key = cacheKey;
+
+    ok = ok && writeBlock(entries, numUniqueItems * sizeof(struct TCacheEntry), &header.entriesOffset)
+            && fseek(cacheTmpFile, 0, SEEK_SET) == 0
+            && fwrite(&header, sizeof(header), 1, cacheTmpFile) == 1;
+
+    if (fclose(cacheTmpFile) != 0)
+        ok = 0;
+
+    cacheTmpFile = NULL;
+
+    // rename() atomically replaces the previous cache on POSIX systems,
+    // even though it is still mapped
+    if (ok) {
+#ifdef _WIN32
+        remove(cacheNewFileName);
+        ok = (rename(cacheTmpFileName, cacheNewFileName) == 0);
+
+        if (ok)
+            cachePendingFileName = fileName;
+#else
+        ok = (rename(cacheTmpFileName, fileName) == 0);
+#endif
+    }
+
+    if (ok) {
+        debugMsg("Saved cache file %s (%d entries)", fileName, numUniqueItems);
+    }
+    else {
+        debugMsg("Warning: couldn't write cache file %s", fileName);
+        remove(cacheTmpFileName);
+    }
+
+    free(entries);
+    free(items);
+}
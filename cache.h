@@ -0,0 +1,37 @@
+/*
+ *  This file is part of 'Johnny Reborn'
+ *
+ *  An open-source engine for the classic
+ *  'Johnny Castaway' screensaver by Sierra.
+ *
+ *  Copyright (C) 2019 Jeremie GUILLAUME
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_PAYLOAD   0   // decompressed resource data
+#define CACHE_TAGS      1   // TTM tags bookmarks
+#define CACHE_PIXELS    2   // BMP / SCR pixels expanded to 8bpp color numbers
+
+void  cacheOpen(char *fileName, uint8 *keyData, uint32 keySize);
+void  *cacheFind(char *resName, int kind, uint32 size);
+int   cacheContains(void *ptr);
+void  cacheAdd(char *resName, int kind, void *data, uint32 size);
+void  cacheSave(void);
+
+#endif
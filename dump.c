@@ -501,15 +501,15 @@ void dumpAllResources()
     createDumpDirs();
 
     for (int i = 0; i < numScrResources; i++)
-        dumpScr(scrResources[i], palResources[0]);
+        dumpScr(findScrResource(scrResources[i]->resName), palResources[0]);
 
     for (int i = 0; i < numBmpResources; i++)
-        dumpBmp(bmpResources[i], palResources[0]);
+        dumpBmp(findBmpResource(bmpResources[i]->resName), palResources[0]);
 
     for (int i = 0; i < numAdsResources; i++)
-        dumpAds(adsResources[i]);
+        dumpAds(findAdsResource(adsResources[i]->resName));
 
     for (int i = 0; i < numTtmResources; i++)
-        dumpTtm(ttmResources[i]);
+        dumpTtm(findTtmResource(ttmResources[i]->resName));
 }
 
@@ -0,0 +1,205 @@
+/*
+ *  This file is part of 'Johnny Reborn'
+ *
+ *  An open-source engine for the classic
+ *  'Johnny Castaway' screensaver by Sierra.
+ *
+ *  Copyright (C) 2019 Jeremie GUILLAUME
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+// 4bpp to 8bpp expansion: each byte of inData holds two pixels
+// (high nibble first) whose color numbers are translated through
+// a 16 entries map
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mytypes.h"
+#include "utils.h"
+#include "expand.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define EXPAND_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define EXPAND_NEON
+#include <arm_neon.h>
+#endif
+
+// Lets GCC and Clang compile the kernels for instruction
+// sets that the rest of the program does not assume
+#if defined(__GNUC__)
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+
+static void expandScalar(uint8 *inData, uint32 inSize, uint8 colorMap[16], uint8 *outPixels)
+{
+    // One 2 bytes store per input byte, from a table of pixel pairs
+    uint8 lut[256][2];
+
+    for (int i=0; i < 256; i++) {
+        lut[i][0] = colorMap[i >> 4];
+        lut[i][1] = colorMap[i & 0xf];
+    }
+
+    for (uint32 i=0; i < inSize; i++)
+        memcpy(outPixels + (i << 1), lut[inData[i]], 2);
+}
+
+
+#ifdef EXPAND_X86
+
+TARGET("ssse3")
+static void expandSSSE3(uint8 *inData, uint32 inSize, uint8 colorMap[16], uint8 *outPixels)
+{
+    // The map fits a 16 bytes register, so pshufb translates
+    // 16 nibbles at once ; high and low ones are then interleaved
+    uint32 i = 0;
+
+    __m128i map  = _mm_loadu_si128((__m128i *) colorMap);
+    __m128i mask = _mm_set1_epi8(0x0f);
+
+    for ( ; i + 16 <= inSize; i += 16) {
+
+        __m128i in = _mm_loadu_si128((__m128i *) (inData + i));
+        __m128i hi = _mm_shuffle_epi8(map, _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(map, _mm_and_si128(in, mask));
+
+        __m128i *out = (__m128i *) (outPixels + (i << 1));
+
+        _mm_storeu_si128(out,     _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(hi, lo));
+    }
+
+    if (i < inSize)
+        expandScalar(inData + i, inSize - i, colorMap, outPixels + (i << 1));
+}
+
+
+TARGET("avx2")
+static void expandAVX2(uint8 *inData, uint32 inSize, uint8 colorMap[16], uint8 *outPixels)
+{
+    // Same as SSSE3 on 32 bytes ; vpunpck works within 128 bits
+    // lanes, so the halves are put back in order before storing
+    uint32 i = 0;
+
+    __m256i map  = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) colorMap));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+
+    for ( ; i + 32 <= inSize; i += 32) {
+
+        __m256i in = _mm256_loadu_si256((__m256i *) (inData + i));
+        __m256i hi = _mm256_shuffle_epi8(map, _mm256_and_si256(_mm256_srli_epi16(in, 4), mask));
+        __m256i lo = _mm256_shuffle_epi8(map, _mm256_and_si256(in, mask));
+
+        __m256i pairsLo = _mm256_unpacklo_epi8(hi, lo);
+        __m256i pairsHi = _mm256_unpackhi_epi8(hi, lo);
+
+        __m256i *out = (__m256i *) (outPixels + (i << 1));
+
+        _mm256_storeu_si256(out,     _mm256_permute2x128_si256(pairsLo, pairsHi, 0x20));
+        _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(pairsLo, pairsHi, 0x31));
+    }
+
+    if (i < inSize)
+        expandScalar(inData + i, inSize - i, colorMap, outPixels + (i << 1));
+}
+
+#endif // EXPAND_X86
+
+
+#ifdef EXPAND_NEON
+
+static void expandNEON(uint8 *inData, uint32 inSize, uint8 colorMap[16], uint8 *outPixels)
+{
+    // Table lookups of the high and low nibbles, which
+    // vst2 interleaves back into pixels order
+    uint32 i = 0;
+
+#if defined(__aarch64__)
+    uint8x16_t map = vld1q_u8(colorMap);
+#else
+    uint8x8x2_t map;
+    map.val[0] = vld1_u8(colorMap);
+    map.val[1] = vld1_u8(colorMap + 8);
+#endif
+
+    uint8x16_t mask = vdupq_n_u8(0x0f);
+
+    for ( ; i + 16 <= inSize; i += 16) {
+
+        uint8x16_t in = vld1q_u8(inData + i);
+        uint8x16_t nibbles[2] = { vshrq_n_u8(in, 4), vandq_u8(in, mask) };
+        uint8x16x2_t pixels;
+
+        for (int n=0; n < 2; n++) {
+#if defined(__aarch64__)
+            pixels.val[n] = vqtbl1q_u8(map, nibbles[n]);
+#else
+            pixels.val[n] = vcombine_u8(vtbl2_u8(map, vget_low_u8(nibbles[n])),
+                                        vtbl2_u8(map, vget_high_u8(nibbles[n])));
+#endif
+        }
+
+        vst2q_u8(outPixels + (i << 1), pixels);
+    }
+
+    if (i < inSize)
+        expandScalar(inData + i, inSize - i, colorMap, outPixels + (i << 1));
+}
+
+#endif // EXPAND_NEON
+
+
+// Fastest first
+struct TExpandKernel expandKernels[] = {
+#ifdef EXPAND_X86
+    { "avx2",   CPU_AVX2,  expandAVX2  },
+    { "ssse3",  CPU_SSSE3, expandSSSE3 },
+#endif
+#ifdef EXPAND_NEON
+    { "neon",   CPU_NEON,  expandNEON  },
+#endif
+    { "scalar", 0,         expandScalar }
+};
+
+int numExpandKernels = sizeof(expandKernels) / sizeof(expandKernels[0]);
+
+static struct TExpandKernel *expandKernel = &expandKernels[sizeof(expandKernels) / sizeof(expandKernels[0]) - 1];
+
+
+void selectExpandKernel(void)
+{
+    // Called once, before any thread may expand pixels
+    uint32 features = getCpuFeatures();
+    int i = 0;
+
+    while ((expandKernels[i].cpuFeatures & features) != expandKernels[i].cpuFeatures)
+        i++;
+
+    expandKernel = &expandKernels[i];
+    debugMsg("Using the %s pixels expansion kernel", expandKernel->name);
+}
+
+
+void expandPixels(uint8 *inData, uint32 inSize, uint8 colorMap[16], uint8 *outPixels)
+{
+    expandKernel->expand(inData, inSize, colorMap, outPixels);
+}
@@ -0,0 +1,39 @@
+/*
+ *  This file is part of 'Johnny Reborn'
+ *
+ *  An open-source engine for the classic
+ *  'Johnny Castaway' screensaver by Sierra.
+ *
+ *  Copyright (C) 2019 Jeremie GUILLAUME
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EXPAND_H
+#define EXPAND_H
+
+struct TExpandKernel {
+    char   *name;
+    uint32 cpuFeatures;     // CPU_* flags the kernel needs
+    void   (*expand)(uint8 *inData, uint32 inSize, uint8 colorMap[16], uint8 *outPixels);
+};
+
+extern struct TExpandKernel expandKernels[];
+extern int numExpandKernels;
+
+void selectExpandKernel(void);
+void expandPixels(uint8 *inData, uint32 inSize, uint8 colorMap[16], uint8 *outPixels);
+
+#endif
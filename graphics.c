@@ -31,82 +31,1464 @@
 #include "graphics.h"
 #include "resource.h"
 #include "events.h"
+#include "cache.h"
 
 
 static PlatformWindow *platform_window;
 
-static uint8 ttmPalette[16][4];
+// Sprites, layers and backgrounds are 8bpp, holding the 16 palette
+// colors plus a couple of reserved ones. They are composed into the
+// frame, which is converted to the window's format when presented.
+#define GR_TRANSPARENT  16      // color key of sprites and layers
+#define GR_BLACK        17      // empty backgrounds
 
-static PlatformSurface *grSavedZonesLayer = NULL;
+static PlatformSurface *grFrameSfc = NULL;
+
+// Palette colors to color numbers: those which look like the
+// 0xa8/0/0xa8 color key are drawn as transparent
+static uint8 grColorMap[16];
+
+// Zones copied by COPY_ZONE_TO_BG, in the order they were copied.
+// Each one is merged into the frame above the background and the
+// clouds, and below the threads' layers, until grRestoreZone()
+struct TSavedZone {
+    int x, y, width, height;
+    uint8 *pixels;
+};
+
+static struct TSavedZone *grSavedZones = NULL;
+static int grNumSavedZones = 0;
+static int grMaxSavedZones = 0;
 
 static PlatformRect grScreenOrigin = { 0, 0, 0, 0 };   // TODO
 
-PlatformSurface *grBackgroundSfc = NULL;
+// Sprite sheets no TTM slot refers to anymore are kept expanded
+// for later use, up to this many bytes of pixels
+#define SPRITE_SHEETS_BUDGET   (8 * 1024 * 1024)
+
+static struct TSpriteSheet **grSpriteSheets = NULL;
+static int    grNumSpriteSheets = 0;
+static uint32 grSpriteSheetsClock = 0;
+static uint32 grIdleSpriteSheetsSize = 0;
+
+// Untouched expanded copies of the SCRs loaded so far, from which
+// the background buffer gets refilled by grLoadScreen()
+struct TScreenCopy {
+    struct TScrResource *scrResource;
+    uint8 *pixels;
+};
+
+static struct TScreenCopy *grScreenCopies = NULL;
+static int   grNumScreenCopies = 0;
+static uint8 *grBackgroundPixels = NULL;
+
+PlatformSurface *grBackgroundSfc = NULL;
+
+int grDx = 0;
+int grDy = 0;
+int grWindowed = 0;
+int grUpdateDelay = 0;
+int grComposeWorkers = 0;
+
+// Regions of the screen, in layers coordinates, drawn to since the last
+// frame: only those get composed again. Overlapping ones are merged.
+#define MAX_DAMAGE_RECTS    32
+
+static PlatformRect grDamageRects[MAX_DAMAGE_RECTS];
+static int grNumDamageRects = 0;
+
+// Layers composed in the last frame, bottom first
+#define MAX_SHOWN_LAYERS    (MAX_TTM_THREADS + 4)
+
+static PlatformSurface *grShownLayers[MAX_SHOWN_LAYERS];
+static int grNumShownLayers = 0;
+
+// The damaged regions are composed in horizontal bands, one per thread:
+// the main thread takes the first one and waits for the workers to be
+// done with theirs. Small updates are not worth waking them up.
+#define MAX_COMPOSE_WORKERS         16
+#define MIN_PARALLEL_COMPOSE_AREA   (64 * 1024)
+
+static PlatformThread *grComposeThreads[MAX_COMPOSE_WORKERS];
+static int grNumComposeThreads = 0;
+static int grNumComposeBands = 1;
+
+static PlatformMutex *grComposeMutex = NULL;
+static PlatformCond *grComposeStartCond = NULL;
+static PlatformCond *grComposeDoneCond = NULL;
+static uint32 grComposeGeneration = 0;
+static int grComposePending = 0;
+static int grComposeQuit = 0;
+
+static PlatformSurface *grComposeLayers[MAX_SHOWN_LAYERS];
+static int grComposeNumLayers = 0;
+static int grComposeZonesIndex = 0;
+static PlatformSurface *grComposeWindowSfc = NULL;
+
+// What has been drawn to each layer from grNewLayer() since it was
+// last cleared: clearing it, or showing and hiding it, damages that
+// much of the screen. Layers are also split in tiles, and only those
+// drawn to are cleared or composed.
+#define MAX_LAYER_EXTENTS   (MAX_TTM_THREADS + 4)
+
+#define LAYER_TILE_SHIFT    5
+#define LAYER_TILE_SIZE     (1 << LAYER_TILE_SHIFT)
+#define LAYER_TILES_X       ((SCREEN_WIDTH  + LAYER_TILE_SIZE - 1) >> LAYER_TILE_SHIFT)
+#define LAYER_TILES_Y       ((SCREEN_HEIGHT + LAYER_TILE_SIZE - 1) >> LAYER_TILE_SHIFT)
+
+#if LAYER_TILES_X > 32
+#error "A row of layer tiles must fit in 32 bits"
+#endif
+
+struct TLayerExtent {
+    PlatformSurface *layer;
+    int x1, y1, x2, y2;     // x1 == x2 when empty
+    uint32 tiles[LAYER_TILES_Y];    // bit n of a row is set when tile n was drawn to
+};
+
+static struct TLayerExtent grLayerExtents[MAX_LAYER_EXTENTS];
+static int grNumLayerExtents = 0;
+
+// Most threads only draw a few sprites between two clears: rather than being
+// drawn into their layer, then composed from it, what they draw
+// is recorded into a display list replayed straight into the frame.
+// The layer gets drawn to for real ('materialized') when its pixels
+// are needed, when something is drawn in the transparent color, or
+// when its list is full ; it then stays so until its next clear.
+#define MAX_DRAW_COMMANDS   64
+
+#define DRAW_SPRITE     0
+#define DRAW_PIXEL      1
+#define DRAW_LINE       2
+#define DRAW_RECT       3
+#define DRAW_CIRCLE     4
+
+struct TDrawCommand {
+    uint8 type;
+    uint8 fgColor, bgColor;     // color numbers, already mapped
+    uint8 flip;
+    int x1, y1, x2, y2;         // the line ends, or the box of anything else
+    int clipX1, clipY1, clipX2, clipY2;
+    struct TSpriteSheet *spriteSheet;   // holding a reference to it
+    struct TSprite *sprite;
+};
+
+struct TDisplayList {
+    PlatformSurface *layer;
+    int isMaterialized;
+    int numCommands;
+    struct TDrawCommand commands[MAX_DRAW_COMMANDS];
+};
+
+static struct TDisplayList grDisplayLists[MAX_LAYER_EXTENTS];
+static int grNumDisplayLists = 0;
+
+// Freed layers are cleared and kept for the next grNewLayer()
+#define MAX_POOLED_LAYERS   (MAX_TTM_THREADS + 4)
+
+static PlatformSurface *grPooledLayers[MAX_POOLED_LAYERS];
+static int grNumPooledLayers = 0;
+static int grNumLayers = 0;
+
+int grLayersHighWater = 0;      // most layers in use at once
+
+
+static void grAddDamage(int x, int y, int width, int height)
+{
+    int x2 = x + width;
+    int y2 = y + height;
+
+    x  = (x  < 0 ? 0 : x);
+    y  = (y  < 0 ? 0 : y);
+    x2 = (x2 > SCREEN_WIDTH  ? SCREEN_WIDTH  : x2);
+    y2 = (y2 > SCREEN_HEIGHT ? SCREEN_HEIGHT : y2);
+
+    if (x >= x2 || y >= y2)
+        return;
+
+    // Swallow every rect the new one overlaps ; the grown rect
+    // may then overlap ones already checked, hence the restart
+    for (int i=0; i < grNumDamageRects; ) {
+
+        PlatformRect *rect = &grDamageRects[i];
+
+        if (x < rect->x + rect->w && rect->x < x2 && y < rect->y + rect->h && rect->y < y2) {
+
+            x2 = (x2 > rect->x + rect->w ? x2 : rect->x + rect->w);
+            y2 = (y2 > rect->y + rect->h ? y2 : rect->y + rect->h);
+            x  = (x < rect->x ? x : rect->x);
+            y  = (y < rect->y ? y : rect->y);
+
+            grDamageRects[i] = grDamageRects[--grNumDamageRects];
+            i = 0;
+        }
+        else {
+            i++;
+        }
+    }
+
+    // Out of rects: everything goes into their bounding box
+    if (grNumDamageRects == MAX_DAMAGE_RECTS) {
+
+        for (int i=0; i < grNumDamageRects; i++) {
+
+            PlatformRect *rect = &grDamageRects[i];
+
+            x2 = (x2 > rect->x + rect->w ? x2 : rect->x + rect->w);
+            y2 = (y2 > rect->y + rect->h ? y2 : rect->y + rect->h);
+            x  = (x < rect->x ? x : rect->x);
+            y  = (y < rect->y ? y : rect->y);
+        }
+
+        grNumDamageRects = 0;
+    }
+
+    PlatformRect rect = { x, y, x2 - x, y2 - y };
+    grDamageRects[grNumDamageRects++] = rect;
+}
+
+
+void grDamageAll(void)
+{
+    grNumDamageRects = 0;
+    grAddDamage(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+}
+
+
+static struct TLayerExtent *grFindLayerExtent(PlatformSurface *sfc)
+{
+    for (int i=0; i < grNumLayerExtents; i++)
+        if (grLayerExtents[i].layer == sfc)
+            return &grLayerExtents[i];
+
+    return NULL;
+}
+
+
+static uint32 grTilesMask(int x1, int x2)
+{
+    // The tiles of a row which pixels x1 to x2 (excluded) lie in
+    int tile1 = x1 >> LAYER_TILE_SHIFT;
+    int tile2 = (x2 - 1) >> LAYER_TILE_SHIFT;
+
+    return (0xffffffff >> (31 - tile2)) & (0xffffffff << tile1);
+}
+
+
+static void grResetLayerExtent(struct TLayerExtent *extent)
+{
+    extent->x1 = extent->y1 = extent->x2 = extent->y2 = 0;
+    memset(extent->tiles, 0, sizeof(extent->tiles));
+}
+
+
+static void grClearLayerTiles(PlatformSurface *sfc, struct TLayerExtent *extent)
+{
+    // Fill the runs of tiles drawn to in each row of tiles,
+    // within the bounding box of what was drawn
+    for (int row=0; row < LAYER_TILES_Y; row++) {
+
+        uint32 tiles = extent->tiles[row];
+        int tile = 0;
+
+        while (tiles) {
+
+            while (!(tiles & 1)) {
+                tiles >>= 1;
+                tile++;
+            }
+
+            int firstTile = tile;
+
+            while (tiles & 1) {
+                tiles >>= 1;
+                tile++;
+            }
+
+            int x1 = firstTile << LAYER_TILE_SHIFT;
+            int y1 = row << LAYER_TILE_SHIFT;
+            int x2 = tile << LAYER_TILE_SHIFT;
+            int y2 = y1 + LAYER_TILE_SIZE;
+
+            x1 = (x1 < extent->x1 ? extent->x1 : x1);
+            y1 = (y1 < extent->y1 ? extent->y1 : y1);
+            x2 = (x2 > extent->x2 ? extent->x2 : x2);
+            y2 = (y2 > extent->y2 ? extent->y2 : y2);
+
+            if (x1 < x2 && y1 < y2) {
+                PlatformRect rect = { x1, y1, x2 - x1, y2 - y1 };
+                platformFillRectIndex(sfc, &rect, GR_TRANSPARENT);
+            }
+        }
+    }
+
+    grResetLayerExtent(extent);
+}
+
+
+static void grDamageLayer(PlatformSurface *sfc, int x, int y, int width, int height)
+{
+    struct TLayerExtent *extent = grFindLayerExtent(sfc);
+
+    grAddDamage(x, y, width, height);
+
+    if (extent == NULL || width <= 0 || height <= 0)
+        return;
+
+    int x1 = (x < 0 ? 0 : x);
+    int y1 = (y < 0 ? 0 : y);
+    int x2 = (x + width  > SCREEN_WIDTH  ? SCREEN_WIDTH  : x + width);
+    int y2 = (y + height > SCREEN_HEIGHT ? SCREEN_HEIGHT : y + height);
+
+    if (x1 < x2 && y1 < y2) {
+
+        uint32 mask = grTilesMask(x1, x2);
+
+        for (int row = y1 >> LAYER_TILE_SHIFT; row <= (y2 - 1) >> LAYER_TILE_SHIFT; row++)
+            extent->tiles[row] |= mask;
+    }
+
+    if (extent->x1 == extent->x2) {
+        extent->x1 = x;
+        extent->y1 = y;
+        extent->x2 = x + width;
+        extent->y2 = y + height;
+    }
+    else {
+        extent->x1 = (x < extent->x1 ? x : extent->x1);
+        extent->y1 = (y < extent->y1 ? y : extent->y1);
+        extent->x2 = (x + width  > extent->x2 ? x + width  : extent->x2);
+        extent->y2 = (y + height > extent->y2 ? y + height : extent->y2);
+    }
+}
+
+
+static void grDamageLayerContents(PlatformSurface *sfc)
+{
+    // Layers which are not tracked could hold anything
+    struct TLayerExtent *extent = grFindLayerExtent(sfc);
+
+    if (extent == NULL)
+        grDamageAll();
+    else
+        grAddDamage(extent->x1, extent->y1, extent->x2 - extent->x1, extent->y2 - extent->y1);
+}
+
+
+static int grFindShownLayer(PlatformSurface **layers, int numLayers, PlatformSurface *sfc)
+{
+    for (int i=0; i < numLayers; i++)
+        if (layers[i] == sfc)
+            return i;
+
+    return -1;
+}
+
+
+static void grDamageShownLayers(PlatformSurface **layers, int numLayers)
+{
+    // Layers showing up or going away damage what they hold,
+    // as long as the ones staying keep their order
+    int lastIndex = -1;
+
+    for (int i=0; i < numLayers; i++) {
+
+        int oldIndex = grFindShownLayer(grShownLayers, grNumShownLayers, layers[i]);
+
+        if (oldIndex == -1) {
+            grDamageLayerContents(layers[i]);
+        }
+        else if (oldIndex < lastIndex) {
+            grDamageAll();
+            break;
+        }
+        else {
+            lastIndex = oldIndex;
+        }
+    }
+
+    for (int i=0; i < grNumShownLayers; i++)
+        if (grFindShownLayer(layers, numLayers, grShownLayers[i]) == -1)
+            grDamageLayerContents(grShownLayers[i]);
+
+    memcpy(grShownLayers, layers, numLayers * sizeof(PlatformSurface *));
+    grNumShownLayers = numLayers;
+}
+
+
+static void grDropSavedZones(void)
+{
+    for (int i=0; i < grNumSavedZones; i++)
+        free(grSavedZones[i].pixels);
+
+    grNumSavedZones = 0;
+}
+
+
+static void grReleaseScreen(void)
+{
+    // The pixels buffer is kept for the next background
+    grDropSavedZones();
+    platformFreeSurface(grBackgroundSfc);
+    grBackgroundSfc = NULL;
+    grDamageAll();
+}
+
+
+static uint8 *grGetScreenCopy(struct TScrResource *scrResource)
+{
+    uint32 pixelsSize = scrResource->width * scrResource->height;
+    char *scrName = scrResource->resName;
+
+    for (int i=0; i < grNumScreenCopies; i++)
+        if (grScreenCopies[i].scrResource == scrResource)
+            return grScreenCopies[i].pixels;
+
+    // There can't be more copies than SCR resources
+    if (grScreenCopies == NULL)
+        grScreenCopies = safe_malloc(numScrResources * sizeof(struct TScreenCopy));
+
+    // A screen expanded by a previous run is used in place
+    uint8 *pixels = cacheFind(scrName, CACHE_PIXELS, pixelsSize);
+
+    if (pixels == NULL) {
+        pixels = safe_malloc(pixelsSize);
+        expandScrResource(scrResource, grColorMap, pixels, pixelsSize);
+        cacheAdd(scrName, CACHE_PIXELS, pixels, pixelsSize);
+    }
+
+    grScreenCopies[grNumScreenCopies].scrResource = scrResource;
+    grScreenCopies[grNumScreenCopies].pixels = pixels;
+    grNumScreenCopies++;
+
+    return pixels;
+}
+
+
+static void grFreeScreens(void)
+{
+    if (grBackgroundSfc != NULL)
+        grReleaseScreen();
+
+    for (int i=0; i < grNumScreenCopies; i++)
+        if (!cacheContains(grScreenCopies[i].pixels))
+            free(grScreenCopies[i].pixels);
+
+    free(grScreenCopies);
+    grScreenCopies = NULL;
+    grNumScreenCopies = 0;
+
+    free(grBackgroundPixels);
+    grBackgroundPixels = NULL;
+}
+
+
+static PlatformSurface *grNewBackground(uint16 width, uint16 height)
+{
+    if (grBackgroundPixels == NULL)
+        grBackgroundPixels = safe_malloc(SCREEN_WIDTH * SCREEN_HEIGHT);
+
+    return platformCreateIndexedSurfaceFrom((void*)grBackgroundPixels, width, height, width);
+}
+
+
+static uint32 grEncodeSpans(uint8 *pixels, uint16 width, uint16 height,
+                            uint32 *rows, struct TSpriteSpan *spans, uint32 numSpans)
+{
+    // List the runs of opaque pixels of each row ; called once with
+    // NULL rows and spans to count them, then again to fill them
+    for (int y=0; y < height; y++) {
+
+        if (rows != NULL)
+            rows[y] = numSpans;
+
+        for (int x=0; x < width; ) {
+
+            while (x < width && pixels[x] == GR_TRANSPARENT)
+                x++;
+
+            int x1 = x;
+
+            while (x < width && pixels[x] != GR_TRANSPARENT)
+                x++;
+
+            if (x > x1) {
+                if (spans != NULL) {
+                    spans[numSpans].x     = x1;
+                    spans[numSpans].width = x - x1;
+                }
+                numSpans++;
+            }
+        }
+
+        pixels += width;
+    }
+
+    if (rows != NULL)
+        rows[height] = numSpans;
+
+    return numSpans;
+}
+
+
+static void grFlipSpriteSheet(struct TSpriteSheet *spriteSheet)
+{
+    // Mirror every row of every sprite once, so that flipped
+    // sprites are drawn by copying spans, just as normal ones
+    uint32 pixelsSize = spriteSheet->pixelsSize;
+    uint8 *outPtr = safe_malloc_array(pixelsSize, sizeof(uint8));
+
+    spriteSheet->flippedPixels = outPtr;
+    spriteSheet->pixelsSize += pixelsSize;
+
+    for (int i=0; i < spriteSheet->numSprites; i++) {
+
+        struct TSprite *sprite = &spriteSheet->sprites[i];
+        uint8 *inPtr = sprite->pixels;
+
+        sprite->flippedPixels = outPtr;
+
+        for (int y=0; y < sprite->height; y++) {
+            for (int x=0; x < sprite->width; x++)
+                outPtr[x] = inPtr[sprite->width - 1 - x];
+
+            inPtr  += sprite->width;
+            outPtr += sprite->width;
+        }
+    }
+}
+
+
+static struct TSpriteSheet *grNewSpriteSheet(struct TBmpResource *bmpResource)
+{
+    struct TSpriteSheet *spriteSheet = safe_malloc(sizeof(struct TSpriteSheet));
+    char *bmpName = bmpResource->resName;
+    uint32 pixelsSize = 0;
+
+    for (int image=0; image < bmpResource->numImages; image++) {
+
+        if ((bmpResource->widths[image] % 2) == 1)
+            fatalError("grLoadBmp(): can't manage odd widths");
+
+        pixelsSize += bmpResource->widths[image] * bmpResource->heights[image];
+    }
+
+    // Sprites expanded by a previous run are used in place, others
+    // are expanded all at once: images follow each other in the
+    // resource data, so they do in the pixels buffer too
+    uint8 *pixels = cacheFind(bmpName, CACHE_PIXELS, pixelsSize);
+    int isCached  = (pixels != NULL);
+
+    if (!isCached) {
+        pixels = safe_malloc_array(pixelsSize, sizeof(uint8));
+        expandBmpResource(bmpResource, grColorMap, pixels, pixelsSize);
+    }
+
+    // Sprites are drawn from the runs of opaque pixels of their rows,
+    // so that transparent pixels are never looked at
+    uint32 numRows  = 0;
+    uint32 numSpans = 0;
+    uint8 *outPtr   = pixels;
+
+    for (int image=0; image < bmpResource->numImages; image++) {
+
+        uint16 width  = bmpResource->widths[image];
+        uint16 height = bmpResource->heights[image];
+
+        numSpans = grEncodeSpans(outPtr, width, height, NULL, NULL, numSpans);
+        numRows += height + 1;
+        outPtr  += width * height;
+    }
+
+    spriteSheet->bmpResource = bmpResource;
+    spriteSheet->refCount    = 0;
+    spriteSheet->pixelsSize  = pixelsSize;
+    spriteSheet->pixels      = pixels;
+    spriteSheet->flippedPixels = NULL;
+    spriteSheet->spans       = safe_malloc_array(numSpans, sizeof(struct TSpriteSpan));
+    spriteSheet->rows        = safe_malloc(numRows * sizeof(uint32));
+    spriteSheet->numSprites  = bmpResource->numImages;
+
+    uint32 *rows = spriteSheet->rows;
+
+    numSpans = 0;
+    outPtr   = pixels;
+
+    for (int image=0; image < bmpResource->numImages; image++) {
+
+        struct TSprite *sprite = &spriteSheet->sprites[image];
+
+        sprite->width  = bmpResource->widths[image];
+        sprite->height = bmpResource->heights[image];
+        sprite->pixels = outPtr;
+        sprite->flippedPixels = NULL;
+        sprite->rows   = rows;
+
+        numSpans = grEncodeSpans(outPtr, sprite->width, sprite->height,
+                                 rows, spriteSheet->spans, numSpans);
+
+        rows   += sprite->height + 1;
+        outPtr += sprite->width * sprite->height;
+    }
+
+    if (!isCached)
+        cacheAdd(bmpName, CACHE_PIXELS, pixels, pixelsSize);
+
+    return spriteSheet;
+}
+
+
+static void grFreeSpriteSheet(struct TSpriteSheet *spriteSheet)
+{
+    if (!cacheContains(spriteSheet->pixels))
+        free(spriteSheet->pixels);
+
+    free(spriteSheet->flippedPixels);
+    free(spriteSheet->spans);
+    free(spriteSheet->rows);
+    free(spriteSheet);
+}
+
+
+static void grEvictSpriteSheets(void)
+{
+    // Free the least recently used idle sheets until the
+    // ones left fit in the budget
+    while (grIdleSpriteSheetsSize > SPRITE_SHEETS_BUDGET) {
+
+        int oldest = -1;
+
+        for (int i=0; i < grNumSpriteSheets; i++)
+            if (grSpriteSheets[i]->refCount == 0
+                    && (oldest == -1 || grSpriteSheets[i]->lastUsed < grSpriteSheets[oldest]->lastUsed))
+                oldest = i;
+
+        debugMsg("Evicting sprites of %s", grSpriteSheets[oldest]->bmpResource->resName);
+
+        grIdleSpriteSheetsSize -= grSpriteSheets[oldest]->pixelsSize;
+        grFreeSpriteSheet(grSpriteSheets[oldest]);
+        grSpriteSheets[oldest] = grSpriteSheets[--grNumSpriteSheets];
+    }
+}
+
+
+static void grUnrefSpriteSheet(struct TSpriteSheet *spriteSheet)
+{
+    // The sheet stays expanded, ready for the next grLoadBmp()
+    if (--spriteSheet->refCount == 0) {
+        grIdleSpriteSheetsSize += spriteSheet->pixelsSize;
+        grEvictSpriteSheets();
+    }
+}
+
+
+static void grFreeSpriteSheets(void)
+{
+    for (int i=0; i < grNumSpriteSheets; i++)
+        grFreeSpriteSheet(grSpriteSheets[i]);
+
+    free(grSpriteSheets);
+    grSpriteSheets = NULL;
+    grNumSpriteSheets = 0;
+    grIdleSpriteSheetsSize = 0;
+}
+
+
+// Where drawing primitives may write to a surface: its clip rect,
+// kept within its bounds. x2 and y2 are excluded.
+struct TRaster {
+    uint8 *pixels;
+    int   pitch;
+    int   x1, y1, x2, y2;
+};
+
+
+static void grGetRaster(PlatformSurface *sfc, struct TRaster *raster)
+{
+    PlatformRect clip;
+
+    platformGetClipRect(sfc, &clip);
+
+    raster->pixels = platformGetSurfacePixels(sfc);
+    raster->pitch  = platformGetSurfacePitch(sfc);
+    raster->x1 = (clip.x > 0 ? clip.x : 0);
+    raster->y1 = (clip.y > 0 ? clip.y : 0);
+    raster->x2 = clip.x + clip.w;
+    raster->y2 = clip.y + clip.h;
+
+    if (raster->x2 > platformGetSurfaceWidth(sfc))
+        raster->x2 = platformGetSurfaceWidth(sfc);
+    if (raster->y2 > platformGetSurfaceHeight(sfc))
+        raster->y2 = platformGetSurfaceHeight(sfc);
+}
+
+
+static void grPutPixel(struct TRaster *raster, int x, int y, uint8 color)
+{
+    if (x >= raster->x1 && y >= raster->y1 && x < raster->x2 && y < raster->y2)
+        raster->pixels[y * raster->pitch + x] = color;
+}
+
+
+static void grDrawHorizontalLine(struct TRaster *raster, int x1, int x2, int y, uint8 color)
+{
+    // From x1 to x2 included
+    if (y < raster->y1 || y >= raster->y2)
+        return;
+
+    x1 = (x1 < raster->x1 ? raster->x1 : x1);
+    x2 = (x2 >= raster->x2 ? raster->x2 - 1 : x2);
+
+    if (x1 <= x2)
+        memset(raster->pixels + y * raster->pitch + x1, color, x2 - x1 + 1);
+}
+
+
+static int grClipLineSteps(int a1, int ainc, int a1Clip, int a2Clip,
+                           int b1, int binc, int b1Clip, int b2Clip,
+                           int dMajor, int dMinor, int cumul0, int *first, int *last)
+{
+    // A Bresenham line walks its major axis one pixel per step, and its
+    // minor axis each time the error term overflows: the minor offset
+    // after i steps is (cumul0 + i*dMinor - 1) / dMajor. Rather than
+    // cutting the line at the clip edges like Cohen-Sutherland would,
+    // which would round the cut ends differently, narrow down the
+    // range of steps [first, last) whose pixels are within the clip.
+    sint64 lo, hi;
+
+    if (ainc > 0) {
+        lo = a1Clip - a1;
+        hi = a2Clip - a1;
+    }
+    else {
+        lo = a1 - a2Clip + 1;
+        hi = a1 - a1Clip + 1;
+    }
+
+    *first = (lo > *first ? lo : *first);
+    *last  = (hi < *last  ? hi : *last);
+
+    if (binc > 0) {
+        lo = b1Clip - b1;
+        hi = b2Clip - 1 - b1;
+    }
+    else {
+        lo = b1 - b2Clip + 1;
+        hi = b1 - b1Clip;
+    }
+
+    if (dMinor == 0)
+        return (lo <= 0 && hi >= 0 && *first < *last);
+
+    if (lo > 0) {
+        sint64 num = lo * dMajor - cumul0 + 1;
+        sint64 step = (num + dMinor - 1) / dMinor;
+        *first = (step > *first ? step : *first);
+    }
+
+    sint64 num = (hi + 1) * dMajor - cumul0 + 1;
+
+    if (num <= 0)
+        return 0;
+
+    sint64 step = (num - 1) / dMinor + 1;
+    *last = (step < *last ? step : *last);
+
+    return (*first < *last);
+}
+
+
+static void grRasterLine(struct TRaster *raster, int x1, int y1, int x2, int y2, uint8 color)
+{
+    // Bresenham's line drawing algorithm
+    // Note : the code below intends to be pixel-perfect
+
+    int dx, dy, cumul, x, y, xinc, yinc;
+    int first = 0, last;
+
+    dx = abs(x2 - x1);
+    dy = abs(y2 - y1);
+
+    xinc = (x2>x1 ? 1 : -1);
+    yinc = (y2>y1 ? 1 : -1);
+
+    if (dy < dx) {
+
+        // Each pixel is one step along x: runs of pixels
+        // on the same row are drawn as horizontal lines
+        last = dx;
+
+        if (!grClipLineSteps(x1, xinc, raster->x1, raster->x2, y1, yinc, raster->y1, raster->y2,
+                             dx, dy, (dx + 1) >> 1, &first, &last))
+            return;
+
+        int minorSteps = ((sint64) first * dy + ((dx + 1) >> 1) - 1) / dx;
+
+        cumul = ((dx + 1) >> 1) + first * dy - minorSteps * dx;
+        x = x1 + first * xinc;
+        y = y1 + minorSteps * yinc;
+
+        int runX = x;
+
+        for (int i=first; i < last; i++) {
+
+            cumul += dy;
+
+            if (cumul > dx || i == last - 1) {
+                grDrawHorizontalLine(raster, (runX < x ? runX : x), (runX < x ? x : runX), y, color);
+                runX = x + xinc;
+            }
+
+            x += xinc;
+
+            if (cumul > dx) {
+                cumul -= dx;
+                y += yinc;
+            }
+        }
+    }
+    else {
+        last = dy;
+
+        if (!grClipLineSteps(y1, yinc, raster->y1, raster->y2, x1, xinc, raster->x1, raster->x2,
+                             dy, dx, (dy + 1) >> 1, &first, &last))
+            return;
+
+        int minorSteps = ((sint64) first * dx + ((dy + 1) >> 1) - 1) / dy;
+
+        cumul = ((dy + 1) >> 1) + first * dx - minorSteps * dy;
+        x = x1 + minorSteps * xinc;
+        y = y1 + first * yinc;
+
+        uint8 *pixel = raster->pixels + y * raster->pitch + x;
+        int pitch = yinc * raster->pitch;
+
+        for (int i=first; i < last; i++) {
+
+            *pixel = color;
+
+            pixel += pitch;
+            cumul += dx;
+
+            if (cumul > dy) {
+                cumul -= dy;
+                pixel += xinc;
+            }
+        }
+    }
+}
+
+
+static void grRasterRect(struct TRaster *raster, int x, int y, int width, int height, uint8 color)
+{
+    // Keep to the clip rect
+    int x1 = (x > raster->x1 ? x : raster->x1);
+    int y1 = (y > raster->y1 ? y : raster->y1);
+    int x2 = (x + width  < raster->x2 ? x + width  : raster->x2);
+    int y2 = (y + height < raster->y2 ? y + height : raster->y2);
+
+    if (x1 >= x2)
+        return;
+
+    for (int j=y1; j < y2; j++)
+        memset(raster->pixels + j * raster->pitch + x1, color, x2 - x1);
+}
+
+
+static void grRasterCircle(struct TRaster *raster, int x1, int y1, int width, uint8 fgColor, uint8 bgColor)
+{
+    if (x1 >= raster->x2 || y1 >= raster->y2 || x1 + width <= raster->x1 || y1 + width <= raster->y1)
+        return;
+
+    // Bresenham's circle drawing algorithm
+    // Note : the code below intends to be pixel-perfect
+
+    int r = (width >> 1) - 1;
+    int xc = x1 + r;
+    int yc = y1 + r;
+    int x = 0;
+    int y = r;
+    int d = 1 - r;
+
+    while (1) {
+
+        grDrawHorizontalLine(raster, xc-x, xc+x+1, yc+y+1, bgColor);
+        grDrawHorizontalLine(raster, xc-x, xc+x+1, yc-y  , bgColor);
+
+        grDrawHorizontalLine(raster, xc-y, xc+y+1, yc+x+1, bgColor);
+        grDrawHorizontalLine(raster, xc-y, xc+y+1, yc-x  , bgColor);
+
+        if (y-x <= 1)
+            break;
+
+        if (d < 0)
+            d += (x << 1) + 3;
+        else {
+            d += ((x - y) << 1) + 5;
+            y--;
+        }
+
+        x++;
+    }
+
+    if (fgColor != bgColor) {
+
+        x = 0;
+        y = r;
+        d = 1 - r;
+
+        while (1) {
+
+            grPutPixel(raster, xc-x  , yc+y+1, fgColor);
+            grPutPixel(raster, xc+x+1, yc+y+1, fgColor);
+
+            grPutPixel(raster, xc-x  , yc-y  , fgColor);
+            grPutPixel(raster, xc+x+1, yc-y  , fgColor);
+
+            grPutPixel(raster, xc-y  , yc+x+1, fgColor);
+            grPutPixel(raster, xc+y+1, yc+x+1, fgColor);
+
+            grPutPixel(raster, xc-y  , yc-x  , fgColor);
+            grPutPixel(raster, xc+y+1, yc-x  , fgColor);
+
+            if (y-x <= 1)
+                break;
+
+            if (d < 0)
+                d += (x << 1) + 3;
+            else {
+                d += ((x - y) << 1) + 5;
+                y--;
+            }
+
+            x++;
+        }
+    }
+}
+
+
+static void grRasterSpans(struct TRaster *raster, struct TSpriteSheet *spriteSheet,
+                          struct TSprite *sprite, int x, int y, int flip)
+{
+    // Copy the opaque spans of the sprite rows which fall within the clip
+    // rect ; when flipped, spans are mirrored around the sprite's middle
+    // and copied from the mirrored pixels
+    uint8 *srcPixels = (flip ? sprite->flippedPixels : sprite->pixels);
+
+    int row1 = (raster->y1 > y ? raster->y1 - y : 0);
+    int row2 = (raster->y2 < y + sprite->height ? raster->y2 - y : sprite->height);
+
+    for (int row=row1; row < row2; row++) {
+
+        uint8 *srcLine = srcPixels + row * sprite->width;
+        uint8 *dstLine = raster->pixels + (y + row) * raster->pitch;
+
+        for (uint32 i=sprite->rows[row]; i < sprite->rows[row+1]; i++) {
+
+            struct TSpriteSpan *span = &spriteSheet->spans[i];
+
+            int x1 = (flip ? x + sprite->width - span->x - span->width : x + span->x);
+            int x2 = x1 + span->width;
+
+            x1 = (x1 < raster->x1 ? raster->x1 : x1);
+            x2 = (x2 > raster->x2 ? raster->x2 : x2);
+
+            if (x1 >= x2)
+                continue;
+
+            memcpy(dstLine + x1, srcLine + x1 - x, x2 - x1);
+        }
+    }
+}
+
+
+static void grReplayCommand(struct TRaster *target, struct TDrawCommand *cmd)
+{
+    // Draw the command within both its own clip rect and the target's
+    struct TRaster raster = *target;
+
+    raster.x1 = (cmd->clipX1 > raster.x1 ? cmd->clipX1 : raster.x1);
+    raster.y1 = (cmd->clipY1 > raster.y1 ? cmd->clipY1 : raster.y1);
+    raster.x2 = (cmd->clipX2 < raster.x2 ? cmd->clipX2 : raster.x2);
+    raster.y2 = (cmd->clipY2 < raster.y2 ? cmd->clipY2 : raster.y2);
+
+    if (raster.x1 >= raster.x2 || raster.y1 >= raster.y2)
+        return;
+
+    switch (cmd->type) {
+
+        case DRAW_SPRITE:
+            grRasterSpans(&raster, cmd->spriteSheet, cmd->sprite, cmd->x1, cmd->y1, cmd->flip);
+            break;
+
+        case DRAW_PIXEL:
+            grPutPixel(&raster, cmd->x1, cmd->y1, cmd->fgColor);
+            break;
+
+        case DRAW_LINE:
+            grRasterLine(&raster, cmd->x1, cmd->y1, cmd->x2, cmd->y2, cmd->fgColor);
+            break;
+
+        case DRAW_RECT:
+            grRasterRect(&raster, cmd->x1, cmd->y1, cmd->x2 - cmd->x1, cmd->y2 - cmd->y1, cmd->fgColor);
+            break;
+
+        case DRAW_CIRCLE:
+            grRasterCircle(&raster, cmd->x1, cmd->y1, cmd->x2 - cmd->x1, cmd->fgColor, cmd->bgColor);
+            break;
+    }
+}
+
+
+static struct TDisplayList *grFindDisplayList(PlatformSurface *sfc)
+{
+    for (int i=0; i < grNumDisplayLists; i++)
+        if (grDisplayLists[i].layer == sfc)
+            return &grDisplayLists[i];
+
+    return NULL;
+}
+
+
+static void grDropDisplayList(struct TDisplayList *displayList)
+{
+    // Back to recording, letting go of the sheets sprites were drawn from
+    for (int i=0; i < displayList->numCommands; i++)
+        if (displayList->commands[i].type == DRAW_SPRITE)
+            grUnrefSpriteSheet(displayList->commands[i].spriteSheet);
+
+    displayList->numCommands = 0;
+    displayList->isMaterialized = 0;
+}
+
+
+static void grDamageDisplayList(struct TDisplayList *displayList)
+{
+    // What each command covered, within its clip rect: a sprite moved
+    // by a few pixels damages little more than itself, whatever else
+    // lies in the layer
+    for (int i=0; i < displayList->numCommands; i++) {
+
+        struct TDrawCommand *cmd = &displayList->commands[i];
+
+        int x1 = cmd->x1;
+        int y1 = cmd->y1;
+        int x2 = cmd->x2;
+        int y2 = cmd->y2;
+
+        if (cmd->type == DRAW_LINE) {
+            x1 = (cmd->x1 < cmd->x2 ? cmd->x1 : cmd->x2);
+            y1 = (cmd->y1 < cmd->y2 ? cmd->y1 : cmd->y2);
+            x2 = (cmd->x1 < cmd->x2 ? cmd->x2 : cmd->x1) + 1;
+            y2 = (cmd->y1 < cmd->y2 ? cmd->y2 : cmd->y1) + 1;
+        }
+
+        x1 = (x1 < cmd->clipX1 ? cmd->clipX1 : x1);
+        y1 = (y1 < cmd->clipY1 ? cmd->clipY1 : y1);
+        x2 = (x2 > cmd->clipX2 ? cmd->clipX2 : x2);
+        y2 = (y2 > cmd->clipY2 ? cmd->clipY2 : y2);
+
+        grAddDamage(x1, y1, x2 - x1, y2 - y1);
+    }
+}
+
+
+static void grMaterializeLayer(PlatformSurface *sfc)
+{
+    struct TDisplayList *displayList = grFindDisplayList(sfc);
+
+    if (displayList == NULL || displayList->isMaterialized)
+        return;
+
+    // The commands' own clip rects apply, not the layer's current one
+    struct TRaster raster = {
+        platformGetSurfacePixels(sfc),
+        platformGetSurfacePitch(sfc),
+        0, 0, platformGetSurfaceWidth(sfc), platformGetSurfaceHeight(sfc)
+    };
+
+    for (int i=0; i < displayList->numCommands; i++)
+        grReplayCommand(&raster, &displayList->commands[i]);
+
+    grDropDisplayList(displayList);
+    displayList->isMaterialized = 1;
+}
+
+
+static struct TDrawCommand *grRecordDraw(PlatformSurface *sfc, int type,
+                                         int x1, int y1, int x2, int y2,
+                                         uint8 fgColor, uint8 bgColor)
+{
+    // The recorded command, or NULL when the caller has to draw into the
+    // layer itself. Drawing in the transparent color erases what the layer
+    // holds, which replaying over the frame could not do.
+    struct TDisplayList *displayList = grFindDisplayList(sfc);
+
+    if (displayList == NULL || displayList->isMaterialized)
+        return NULL;
+
+    if (fgColor == GR_TRANSPARENT || bgColor == GR_TRANSPARENT
+            || displayList->numCommands == MAX_DRAW_COMMANDS) {
+        grMaterializeLayer(sfc);
+        return NULL;
+    }
+
+    struct TDrawCommand *cmd = &displayList->commands[displayList->numCommands++];
+    struct TRaster raster;
+
+    grGetRaster(sfc, &raster);
+
+    cmd->type    = type;
+    cmd->fgColor = fgColor;
+    cmd->bgColor = bgColor;
+    cmd->flip    = 0;
+    cmd->x1 = x1;
+    cmd->y1 = y1;
+    cmd->x2 = x2;
+    cmd->y2 = y2;
+    cmd->clipX1 = raster.x1;
+    cmd->clipY1 = raster.y1;
+    cmd->clipX2 = raster.x2;
+    cmd->clipY2 = raster.y2;
+    cmd->spriteSheet = NULL;
+    cmd->sprite = NULL;
+
+    return cmd;
+}
+
+
+void grLoadPalette(struct TPalResource *palResource)
+{
+    if (palResource == NULL)
+        fatalError("NULL palette\n");
+
+    for (int i=0; i < 16; i++) {
+
+        uint8 r = palResource->colors[i].r << 2;
+        uint8 g = palResource->colors[i].g << 2;
+        uint8 b = palResource->colors[i].b << 2;
+
+        platformSetPaletteColor(grFrameSfc, i, r, g, b);
+        grColorMap[i] = (r == 0xa8 && g == 0 && b == 0xa8 ? GR_TRANSPARENT : i);
+    }
+
+    platformSetPaletteColor(grFrameSfc, GR_TRANSPARENT, 0xa8, 0, 0xa8);
+    platformSetPaletteColor(grFrameSfc, GR_BLACK, 0, 0, 0);
+}
+
+
+static void grPresentFrame(void)
+{
+    platformBlitSurface(grFrameSfc, NULL, platformGetWindowSurface(platform_window), NULL);
+    platformUpdateWindow(platform_window);
+}
+
+
+static void grMergeLine(uint8 *line, uint8 *layerLine, int k1, int k2)
+{
+    for (int k=k1; k < k2; k++)
+        line[k] = (layerLine[k] == GR_TRANSPARENT ? line[k] : layerLine[k]);
+}
+
+
+static void grMergeLayers(PlatformSurface **layers, int numLayers, int x, int y, int width, int height)
+{
+    // Compose the rect into the frame one line at a time: the line
+    // is built from every layer in a buffer which stays in cache, and
+    // written to the frame once. Layers are keyed on GR_TRANSPARENT
+    // except for the background, which hides whatever lies below it.
+    uint8 line[SCREEN_WIDTH];
+
+    uint8 *framePixels = platformGetSurfacePixels(grFrameSfc);
+    int framePitch = platformGetSurfacePitch(grFrameSfc);
+
+    uint8 *layerPixels[MAX_SHOWN_LAYERS];
+    int layerPitches[MAX_SHOWN_LAYERS];
+    int layerWidths[MAX_SHOWN_LAYERS];
+    int layerHeights[MAX_SHOWN_LAYERS];
+    struct TLayerExtent *layerExtents[MAX_SHOWN_LAYERS];
+
+    for (int i=0; i < numLayers; i++) {
+
+        layerPixels[i]  = platformGetSurfacePixels(layers[i]);
+        layerPitches[i] = platformGetSurfacePitch(layers[i]);
+        layerWidths[i]  = platformGetSurfaceWidth(layers[i]);
+        layerHeights[i] = platformGetSurfaceHeight(layers[i]);
+        layerExtents[i] = grFindLayerExtent(layers[i]);
+    }
+
+    for (int j=y; j < y + height; j++) {
+
+        uint8 *frameLine = framePixels
+                         + (j + grScreenOrigin.y) * framePitch
+                         + x + grScreenOrigin.x;
+
+        // Start from the top-most background covering the whole line,
+        // or from what the frame already holds when there is none
+        int first = numLayers - 1;
+
+        while (first >= 0 && !(layers[first] == grBackgroundSfc
+                               && j < layerHeights[first]
+                               && x + width <= layerWidths[first]))
+            first--;
+
+        if (first >= 0)
+            memcpy(line, layerPixels[first] + j * layerPitches[first] + x, width);
+        else
+            memcpy(line, frameLine, width);
+
+        for (int i=first+1; i < numLayers; i++) {
+
+            int lineWidth = (x + width > layerWidths[i] ? layerWidths[i] - x : width);
+
+            if (j >= layerHeights[i] || lineWidth <= 0)
+                continue;
+
+            uint8 *layerLine = layerPixels[i] + j * layerPitches[i] + x;
+
+            if (layers[i] == grBackgroundSfc) {
+                memcpy(line, layerLine, lineWidth);
+                continue;
+            }
+
+            struct TLayerExtent *extent = layerExtents[i];
+
+            if (extent == NULL) {
+                grMergeLine(line, layerLine, 0, lineWidth);
+                continue;
+            }
+
+            // Out of the bounding box of what was drawn, or of the tiles
+            // drawn to, the layer is all transparent: only the runs of
+            // tiles drawn to are merged, within the bounding box
+            if (j < extent->y1 || j >= extent->y2)
+                continue;
+
+            int extentK1 = extent->x1 - x;
+            int extentK2 = (extent->x2 - x < lineWidth ? extent->x2 - x : lineWidth);
+
+            uint32 tiles = extent->tiles[j >> LAYER_TILE_SHIFT] & grTilesMask(x, x + lineWidth);
+            int tile = 0;
+
+            while (tiles) {
 
-int grDx = 0;
-int grDy = 0;
-int grWindowed = 0;
-int grUpdateDelay = 0;
+                while (!(tiles & 1)) {
+                    tiles >>= 1;
+                    tile++;
+                }
 
+                int firstTile = tile;
 
-static void grReleaseScreen(void)
+                while (tiles & 1) {
+                    tiles >>= 1;
+                    tile++;
+                }
+
+                int k1 = (firstTile << LAYER_TILE_SHIFT) - x;
+                int k2 = (tile << LAYER_TILE_SHIFT) - x;
+
+                k1 = (k1 < extentK1 ? extentK1 : k1);
+                k1 = (k1 < 0 ? 0 : k1);
+                k2 = (k2 > extentK2 ? extentK2 : k2);
+
+                grMergeLine(line, layerLine, k1, k2);
+            }
+        }
+
+        memcpy(frameLine, line, width);
+    }
+}
+
+
+static void grMergeSavedZones(struct TRaster *raster)
 {
-    free(platformGetSurfacePixels(grBackgroundSfc));
-    platformFreeSurface(grBackgroundSfc);
-    grBackgroundSfc = NULL;
+    // Merge the saved zones into the raster, in the order they were copied
+    for (int i=0; i < grNumSavedZones; i++) {
+
+        struct TSavedZone *zone = &grSavedZones[i];
+
+        int x1 = (zone->x > raster->x1 ? zone->x : raster->x1);
+        int y1 = (zone->y > raster->y1 ? zone->y : raster->y1);
+        int x2 = (zone->x + zone->width  < raster->x2 ? zone->x + zone->width  : raster->x2);
+        int y2 = (zone->y + zone->height < raster->y2 ? zone->y + zone->height : raster->y2);
+
+        for (int j=y1; j < y2; j++)
+            grMergeLine(raster->pixels + j * raster->pitch + x1,
+                        zone->pixels + (j - zone->y) * zone->width + x1 - zone->x,
+                        0, x2 - x1);
+    }
 }
 
 
-static void grReleaseSavedLayer(void)
+static void grComposeRect(PlatformSurface **layers, int numLayers, int zonesIndex, PlatformRect *rect)
 {
-    platformFreeSurface(grSavedZonesLayer);
-    grSavedZonesLayer = NULL;
+    int x = rect->x;
+    int y = rect->y;
+    int width = rect->w;
+    int height = rect->h;
+
+    // Keep to the frame, whatever the screen origin
+    if (x + grScreenOrigin.x < 0) {
+        width += x + grScreenOrigin.x;
+        x = -grScreenOrigin.x;
+    }
+    if (y + grScreenOrigin.y < 0) {
+        height += y + grScreenOrigin.y;
+        y = -grScreenOrigin.y;
+    }
+    if (x + grScreenOrigin.x + width > platformGetSurfaceWidth(grFrameSfc))
+        width = platformGetSurfaceWidth(grFrameSfc) - x - grScreenOrigin.x;
+    if (y + grScreenOrigin.y + height > platformGetSurfaceHeight(grFrameSfc))
+        height = platformGetSurfaceHeight(grFrameSfc) - y - grScreenOrigin.y;
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    // The frame, in layers coordinates, limited to the rect
+    int framePitch = platformGetSurfacePitch(grFrameSfc);
+
+    struct TRaster frameRaster = {
+        (uint8 *) platformGetSurfacePixels(grFrameSfc)
+            + grScreenOrigin.y * framePitch + grScreenOrigin.x,
+        framePitch,
+        x, y, x + width, y + height
+    };
+
+    // Runs of layers holding pixels are merged line by line, and
+    // the display lists of the others replayed over the result. The
+    // saved zones go in between the layers, at zonesIndex.
+    if (grNumSavedZones == 0)
+        zonesIndex = -1;
+
+    for (int i=0; i < numLayers || i == zonesIndex; ) {
+
+        if (i == zonesIndex) {
+            grMergeSavedZones(&frameRaster);
+            zonesIndex = -1;
+            continue;
+        }
+
+        struct TDisplayList *displayList = grFindDisplayList(layers[i]);
+
+        if (displayList != NULL && !displayList->isMaterialized) {
+
+            for (int j=0; j < displayList->numCommands; j++)
+                grReplayCommand(&frameRaster, &displayList->commands[j]);
+
+            i++;
+            continue;
+        }
+
+        int first = i;
+
+        while (++i < numLayers && i != zonesIndex) {
+            displayList = grFindDisplayList(layers[i]);
+            if (displayList != NULL && !displayList->isMaterialized)
+                break;
+        }
+
+        grMergeLayers(layers + first, i - first, x, y, width, height);
+    }
 }
 
 
-static void grPutPixel(PlatformSurface *sfc, uint16 x, uint16 y, uint8 color)
+static void grComposeBand(int band)
 {
-    // TODO: Implement Cohen-Sutherland clipping algorithm or such for
-    // grDrawLine(), and another ad hoc algorithm for grDrawCircle()
+    // Compose and present the damaged regions which lie in the band
+    int y1 = band * SCREEN_HEIGHT / grNumComposeBands;
+    int y2 = (band + 1) * SCREEN_HEIGHT / grNumComposeBands;
+
+    for (int i=0; i < grNumDamageRects; i++) {
 
-    if (x>=0 && y>=0 && x<SCREEN_WIDTH && y<SCREEN_HEIGHT) {
+        PlatformRect src = grDamageRects[i];
+        int srcY1 = (src.y > y1 ? src.y : y1);
+        int srcY2 = (src.y + src.h < y2 ? src.y + src.h : y2);
 
-        uint8 *pixel = platformGetSurfacePixels(sfc);
+        if (srcY1 >= srcY2)
+            continue;
 
-        pixel += (y * platformGetSurfacePitch(sfc)) + (x * platformGetSurfaceBytesPerPixel(sfc));
+        src.y = srcY1;
+        src.h = srcY2 - srcY1;
 
-        pixel[0] = ttmPalette[color][0];
-        pixel[1] = ttmPalette[color][1];
-        pixel[2] = ttmPalette[color][2];
-        pixel[3] = 0;
+        PlatformRect dest = { src.x + grScreenOrigin.x, src.y + grScreenOrigin.y, src.w, src.h };
+
+        grComposeRect(grComposeLayers, grComposeNumLayers, grComposeZonesIndex, &src);
+        platformBlitSurface(grFrameSfc, &dest, grComposeWindowSfc, &dest);
     }
 }
 
 
-static void grDrawHorizontalLine(PlatformSurface *sfc, sint16 x1, sint16 x2, sint16 y, uint8 color)
+static void grComposeWorker(void *arg)
 {
-    if (y < 0 || y > 479)
-        return;
+    int band = (int) (intptr_t) arg;
+    uint32 generation = 0;
+
+    platformLockMutex(grComposeMutex);
+
+    while (1) {
+
+        while (grComposeGeneration == generation && !grComposeQuit)
+            platformWaitCond(grComposeStartCond, grComposeMutex);
+
+        if (grComposeQuit)
+            break;
 
-    x1 = x1 < 0   ? 0   : x1;
-    x2 = x2 > 639 ? 639 : x2;
+        generation = grComposeGeneration;
+        platformUnlockMutex(grComposeMutex);
+
+        grComposeBand(band);
+
+        platformLockMutex(grComposeMutex);
+
+        if (--grComposePending == 0)
+            platformBroadcastCond(grComposeDoneCond);
+    }
 
-    for (int x=x1; x<=x2; x++)
-        grPutPixel(sfc, x, y, color);
+    platformUnlockMutex(grComposeMutex);
 }
 
 
-void grLoadPalette(struct TPalResource *palResource)
+static void grStartComposeWorkers(void)
 {
-    if (palResource == NULL)
-        fatalError("NULL palette\n");
+    int numWorkers = (grComposeWorkers > 0 ? grComposeWorkers : platformGetCPUCount());
 
-    for (int i=0; i < 16; i++) {
-        ttmPalette[i][0] = palResource->colors[i].b << 2;
-        ttmPalette[i][1] = palResource->colors[i].g << 2;
-        ttmPalette[i][2] = palResource->colors[i].r << 2;
-        ttmPalette[i][3] = 0;
+    if (numWorkers > MAX_COMPOSE_WORKERS)
+        numWorkers = MAX_COMPOSE_WORKERS;
+
+    // The main thread composes the first band itself
+    grNumComposeThreads = 0;
+    grComposeGeneration = 0;
+
+    for (int i=1; i < numWorkers; i++) {
+
+        grComposeThreads[grNumComposeThreads] =
+            platformCreateThread(grComposeWorker, (void *) (intptr_t) i);
+
+        if (grComposeThreads[grNumComposeThreads] == NULL)
+            break;
+
+        grNumComposeThreads++;
     }
+
+    grNumComposeBands = grNumComposeThreads + 1;
+
+    debugMsg("Composing the screen with %d threads", grNumComposeBands);
+}
+
+
+static void grStopComposeWorkers(void)
+{
+    platformLockMutex(grComposeMutex);
+    grComposeQuit = 1;
+    platformBroadcastCond(grComposeStartCond);
+    platformUnlockMutex(grComposeMutex);
+
+    for (int i=0; i < grNumComposeThreads; i++)
+        platformJoinThread(grComposeThreads[i]);
+
+    grComposeQuit = 0;
+    grNumComposeThreads = 0;
+    grNumComposeBands = 1;
 }
 
 
@@ -127,6 +1509,19 @@ void graphicsInit(void)
     grScreenOrigin.x = (SCREEN_WIDTH - 640) / 2;
     grScreenOrigin.y = (SCREEN_HEIGHT - 480) / 2;
 
+    grFrameSfc = platformCreateIndexedSurface(SCREEN_WIDTH, SCREEN_HEIGHT);
+    platformFillRectIndex(grFrameSfc, NULL, GR_BLACK);
+    grDamageAll();
+
+    grComposeMutex     = platformCreateMutex();
+    grComposeStartCond = platformCreateCond();
+    grComposeDoneCond  = platformCreateCond();
+
+    if (grComposeMutex == NULL || grComposeStartCond == NULL || grComposeDoneCond == NULL)
+        fatalError("Could not create the screen composing lock");
+
+    grStartComposeWorkers();
+
     if (!grWindowed)
         platformShowCursor(0);
 
@@ -142,11 +1537,35 @@ void graphicsInit(void)
 
 void graphicsEnd(void)
 {
+    debugMsg("Layers high-water mark: %d", grLayersHighWater);
+
+    for (int i=0; i < grNumPooledLayers; i++)
+        platformFreeSurface(grPooledLayers[i]);
+
+    grNumPooledLayers = 0;
+
+    grStopComposeWorkers();
+    platformDestroyCond(grComposeDoneCond);
+    platformDestroyCond(grComposeStartCond);
+    platformDestroyMutex(grComposeMutex);
+
+    grFreeSpriteSheets();
+    grFreeScreens();
+    platformFreeSurface(grFrameSfc);
+    grFrameSfc = NULL;
     platformDestroyWindow(platform_window);
     platformShutdown();
 }
 
 
+void grSetComposeWorkers(int numWorkers)
+{
+    grStopComposeWorkers();
+    grComposeWorkers = numWorkers;
+    grStartComposeWorkers();
+}
+
+
 void grRefreshDisplay(void)
 {
     platformUpdateWindow(platform_window);
@@ -175,59 +1594,110 @@ void grUpdateDisplay(struct TTtmThread *ttmBackgroundThread,
                      struct TTtmThread *ttmHolidayThread,
                      struct TTtmThread *ttmCloudsThread)
 {
-    PlatformSurface* windowSurface = platformGetWindowSurface(platform_window);
-    
-    // Blit the background
+    // From bottom to top: the background, the clouds, the zones
+    // copied to the background, each thread's layer and the holiday
+    // layer
+    PlatformSurface *layers[MAX_SHOWN_LAYERS];
+    int numLayers = 0;
+    int zonesIndex;
+
+    // The background
     if (grBackgroundSfc != NULL)
-        platformBlitSurface(grBackgroundSfc,
-                        NULL,
-                        windowSurface,
-                        &grScreenOrigin);
+        layers[numLayers++] = grBackgroundSfc;
 
-    // Blit the Clouds
+    // The Clouds
     if (ttmCloudsThread != NULL)
         if (ttmCloudsThread->isRunning)
-            platformBlitSurface(ttmCloudsThread->ttmLayer,
-                            NULL,
-                            windowSurface,
-                            &grScreenOrigin);
-
-    // If not NULL, blit the optional layer of saved zones
-    if (grSavedZonesLayer != NULL)
-        platformBlitSurface(grSavedZonesLayer,
-                        NULL,
-                        windowSurface,
-                        &grScreenOrigin);
+            layers[numLayers++] = ttmCloudsThread->ttmLayer;
 
+    // The saved zones, merged in by grComposeRect()
+    zonesIndex = numLayers;
 
-    // Blit successively each thread's layer
+    // Successively each thread's layer
     for (int i=0; i < MAX_TTM_THREADS; i++)
         if (ttmThreads[i].isRunning)
-            platformBlitSurface(ttmThreads[i].ttmLayer,
-                            NULL,
-                            windowSurface,
-                            &grScreenOrigin);
+            layers[numLayers++] = ttmThreads[i].ttmLayer;
 
-    // Finally, blit the holiday layer
+    // Finally, the holiday layer
     if (ttmHolidayThread != NULL)
         if (ttmHolidayThread->isRunning)
-            platformBlitSurface(ttmHolidayThread->ttmLayer,
-                            NULL,
-                            windowSurface,
-                            &grScreenOrigin);
+            layers[numLayers++] = ttmHolidayThread->ttmLayer;
+
+    if (numLayers != grNumShownLayers
+            || memcmp(layers, grShownLayers, numLayers * sizeof(PlatformSurface *)))
+        grDamageShownLayers(layers, numLayers);
+
+    // Compose the damaged regions only, and bring them to the window
+    int damagedArea = 0;
+
+    for (int i=0; i < grNumDamageRects; i++)
+        damagedArea += grDamageRects[i].w * grDamageRects[i].h;
+
+    memcpy(grComposeLayers, layers, numLayers * sizeof(PlatformSurface *));
+    grComposeNumLayers = numLayers;
+    grComposeZonesIndex = zonesIndex;
+    grComposeWindowSfc = platformGetWindowSurface(platform_window);
+
+    if (grNumComposeThreads == 0 || damagedArea < MIN_PARALLEL_COMPOSE_AREA) {
+        for (int band=0; band < grNumComposeBands; band++)
+            grComposeBand(band);
+    }
+    else {
+        platformLockMutex(grComposeMutex);
+        grComposePending = grNumComposeThreads;
+        grComposeGeneration++;
+        platformBroadcastCond(grComposeStartCond);
+        platformUnlockMutex(grComposeMutex);
+
+        grComposeBand(0);
+
+        platformLockMutex(grComposeMutex);
+        while (grComposePending > 0)
+            platformWaitCond(grComposeDoneCond, grComposeMutex);
+        platformUnlockMutex(grComposeMutex);
+    }
+
+    grNumDamageRects = 0;
 
     // Wait for the tick ...
     eventsWaitTick(grUpdateDelay);
 
-    // ... and refresh the display
+    // ... and refresh the display. The bands above cover the conversion
+    // to the window's pixels as well ; what is left is a single call to
+    // the platform, which scales the 640x480 frame to the display, if
+    // needed, on its own
     platformUpdateWindow(platform_window);
 }
+
+
 PlatformSurface *grNewLayer(void)
 {
-    PlatformSurface *sfc = platformCreateSurface(SCREEN_WIDTH, SCREEN_HEIGHT);
-    PlatformRect dest = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
-    platformFillRect(sfc, &dest, 0xa8, 0, 0xa8, 0);
-    platformSetColorKey(sfc, 0xa8, 0, 0xa8);
+    PlatformSurface *sfc;
+
+    if (grNumPooledLayers > 0) {
+        sfc = grPooledLayers[--grNumPooledLayers];
+    }
+    else {
+        sfc = platformCreateIndexedSurface(SCREEN_WIDTH, SCREEN_HEIGHT);
+        platformFillRectIndex(sfc, NULL, GR_TRANSPARENT);
+        platformSetColorKeyIndex(sfc, GR_TRANSPARENT);
+    }
+
+    if (++grNumLayers > grLayersHighWater)
+        grLayersHighWater = grNumLayers;
+
+    if (grNumLayerExtents < MAX_LAYER_EXTENTS) {
+        struct TLayerExtent *extent = &grLayerExtents[grNumLayerExtents++];
+        extent->layer = sfc;
+        grResetLayerExtent(extent);
+    }
+
+    if (grNumDisplayLists < MAX_LAYER_EXTENTS) {
+        struct TDisplayList *displayList = &grDisplayLists[grNumDisplayLists++];
+        displayList->layer = sfc;
+        displayList->numCommands = 0;
+        displayList->isMaterialized = 0;
+    }
 
     return sfc;
 }
@@ -235,7 +1705,43 @@ PlatformSurface *grNewLayer(void)
 
 void grFreeLayer(PlatformSurface *sfc)
 {
-    platformFreeSurface(sfc);
+    struct TLayerExtent *extent = grFindLayerExtent(sfc);
+    struct TDisplayList *displayList = grFindDisplayList(sfc);
+    int shownIndex = grFindShownLayer(grShownLayers, grNumShownLayers, sfc);
+
+    // Its contents go away now ; forget it before
+    // its address gets reused by another layer
+    if (shownIndex != -1) {
+        grDamageLayerContents(sfc);
+        memmove(&grShownLayers[shownIndex], &grShownLayers[shownIndex + 1],
+                (--grNumShownLayers - shownIndex) * sizeof(PlatformSurface *));
+    }
+
+    grNumLayers--;
+
+    if (grNumPooledLayers == MAX_POOLED_LAYERS) {
+        platformFreeSurface(sfc);
+    }
+    else {
+        // Only the tiles drawn to since the last clear need to be
+        // cleared, and none if all was kept in the display list
+        platformSetClipRect(sfc, NULL);
+
+        if (extent == NULL)
+            platformFillRectIndex(sfc, NULL, GR_TRANSPARENT);
+        else if (displayList == NULL || displayList->isMaterialized)
+            grClearLayerTiles(sfc, extent);
+
+        grPooledLayers[grNumPooledLayers++] = sfc;
+    }
+
+    if (extent != NULL)
+        *extent = grLayerExtents[--grNumLayerExtents];
+
+    if (displayList != NULL) {
+        grDropDisplayList(displayList);
+        *displayList = grDisplayLists[--grNumDisplayLists];
+    }
 }
 
 
@@ -252,12 +1758,45 @@ void grSetClipZone(PlatformSurface *sfc, sint16 x1, sint16 y1, sint16 x2, sint16
 void grCopyZoneToBg(PlatformSurface *sfc, uint16 x, uint16 y, uint16 width, uint16 height)
 {
     x += grDx; y += grDy;
-    PlatformRect rect = { (short) x, (short) y, width + 2, height };
 
-    if (grSavedZonesLayer == NULL)
-        grSavedZonesLayer = grNewLayer();
+    // Keep to the layer
+    int x1 = (short) x;
+    int y1 = (short) y;
+    int x2 = x1 + width + 2;
+    int y2 = y1 + height;
+
+    x1 = (x1 < 0 ? 0 : x1);
+    y1 = (y1 < 0 ? 0 : y1);
+    x2 = (x2 > platformGetSurfaceWidth(sfc) ? platformGetSurfaceWidth(sfc) : x2);
+    y2 = (y2 > platformGetSurfaceHeight(sfc) ? platformGetSurfaceHeight(sfc) : y2);
+
+    if (x1 >= x2 || y1 >= y2)
+        return;
+
+    if (grNumSavedZones == grMaxSavedZones) {
+        grMaxSavedZones = (grMaxSavedZones > 0 ? grMaxSavedZones * 2 : 8);
+        grSavedZones = safe_realloc(grSavedZones, grMaxSavedZones * sizeof(struct TSavedZone));
+    }
+
+    struct TSavedZone *zone = &grSavedZones[grNumSavedZones++];
+
+    zone->x = x1;
+    zone->y = y1;
+    zone->width  = x2 - x1;
+    zone->height = y2 - y1;
+    zone->pixels = safe_malloc(zone->width * zone->height);
+
+    // The zone keeps the layer's transparent pixels, so that it is
+    // keyed like the layer when merged into the frame
+    grMaterializeLayer(sfc);
+
+    uint8 *layerPixels = platformGetSurfacePixels(sfc);
+    int layerPitch = platformGetSurfacePitch(sfc);
 
-    platformBlitSurface(sfc, &rect, grSavedZonesLayer, &rect);
+    for (int j=0; j < zone->height; j++)
+        memcpy(zone->pixels + j * zone->width, layerPixels + (y1 + j) * layerPitch + x1, zone->width);
+
+    grAddDamage(x1, y1, x2 - x1, y2 - y1);
 
     // Note : without the +2 in width+2 above, there would be a graphical
     // glitch (2 unfilled pixels) on the hull of the cargo, caused by an
@@ -279,100 +1818,77 @@ void grSaveImage1(PlatformSurface *sfc, uint16 arg0, uint16 arg1, uint16 arg2, u
 void grSaveZone(PlatformSurface *sfc, uint16 x, uint16 y, uint16 width, uint16 height)
 {
     // Minimalistic implementation: we don't really save the zone,
-    // and let grRestoreZone() simply erase the 'saved zones' layer
+    // and let grRestoreZone() simply drop every zone copied to the
+    // background
 }
 
 
 void grRestoreZone(PlatformSurface *sfc, uint16 x, uint16 y, uint16 width, uint16 height)
 {
     // In Johnny's TTMs, we never have RESTORE_ZONE called
-    // while several zones are saved. So we simply free the
-    // whole saved zones layer
-    grReleaseSavedLayer();
+    // while several zones are saved. So we simply drop
+    // all of them
+    for (int i=0; i < grNumSavedZones; i++)
+        grAddDamage(grSavedZones[i].x, grSavedZones[i].y, grSavedZones[i].width, grSavedZones[i].height);
+
+    grDropSavedZones();
 }
 
 
 void grDrawPixel(PlatformSurface *sfc, sint16 x, sint16 y, uint8 color)
 {
+    struct TRaster raster;
+
     x += grDx; y += grDy;
-    grPutPixel(sfc, x, y, color);
+    grDamageLayer(sfc, x, y, 1, 1);
+    color = grColorMap[color];
+
+    if (grRecordDraw(sfc, DRAW_PIXEL, x, y, x + 1, y + 1, color, color) != NULL)
+        return;
+
+    grGetRaster(sfc, &raster);
+    grPutPixel(&raster, x, y, color);
 }
 
 
 void grDrawLine(PlatformSurface *sfc, sint16 x1, sint16 y1, sint16 x2, sint16 y2, uint8 color)
 {
+    struct TRaster raster;
+
     x1 += grDx; y1 += grDy;
     x2 += grDx; y2 += grDy;
 
-    platformLockSurface(sfc);
-
-    // Bresenham's line drawing algorithm
-    // Note : the code below intends to be pixel-perfect
-
-    uint16 dx, dy, cumul, x, y;
-    int xinc, yinc;
-
-    x = x1;
-    y = y1;
-    dx = abs(x2 - x1);
-    dy = abs(y2 - y1);
-
-    xinc = (x2>x1 ? 1 : -1);
-    yinc = (y2>y1 ? 1 : -1);
-
-    if (dy < dx) {
-        cumul = (dx + 1) >> 1;
-
-        for (int i=0; i < dx; i++) {
-
-            grPutPixel(sfc, x, y, color);
-
-            x += xinc;
-            cumul += dy;
-
-            if (cumul > dx) {
-                cumul -= dx;
-                y += yinc;
-            }
-        }
-    }
-    else {
-        cumul = (dy + 1) >> 1;
-
-        for (int i=0; i < dy; i++) {
-
-            grPutPixel(sfc, x, y, color);
-
-            y += yinc;
-            cumul += dx;
+    grDamageLayer(sfc, (x1 < x2 ? x1 : x2), (y1 < y2 ? y1 : y2), abs(x2 - x1) + 1, abs(y2 - y1) + 1);
+    color = grColorMap[color];
 
-            if (cumul > dy) {
-                cumul -= dy;
-                x += xinc;
-            }
-        }
-    }
+    if (grRecordDraw(sfc, DRAW_LINE, x1, y1, x2, y2, color, color) != NULL)
+        return;
 
-    platformUnlockSurface(sfc);
+    grGetRaster(sfc, &raster);
+    grRasterLine(&raster, x1, y1, x2, y2, color);
 }
 
 
 void grDrawRect(PlatformSurface *sfc, sint16 x, sint16 y, uint16 width, uint16 height, uint8 color)
 {
+    struct TRaster raster;
+
     x += grDx; y += grDy;
+    grDamageLayer(sfc, x, y, width, height);
+    color = grColorMap[color];
 
-    PlatformRect dest = { x, y, width, height };
-    platformFillRect(sfc, &dest,
-                     ttmPalette[color][2],  // TODO ?
-                     ttmPalette[color][1],
-                     ttmPalette[color][0],
-                     0
-    );
+    if (grRecordDraw(sfc, DRAW_RECT, x, y, x + width, y + height, color, color) != NULL)
+        return;
+
+    grGetRaster(sfc, &raster);
+    grRasterRect(&raster, x, y, width, height, color);
 }
 
 
 void grDrawCircle(PlatformSurface *sfc, sint16 x1, sint16 y1, uint16 width, uint16 height, uint8 fgColor, uint8 bgColor)
 {
+    struct TRaster raster;
+
     x1 += grDx; y1 += grDy;
 
     // We can only draw regular circles
@@ -387,112 +1903,74 @@ void grDrawCircle(PlatformSurface *sfc, sint16 x1, sint16 y1, uint16 width, uint
         return;
     }
 
-    // Bresenham's circle drawing algorithm
-    // Note : the code below intends to be pixel-perfect
-
-    platformLockSurface(sfc);
-
-    uint16 r = (width >> 1) - 1;
-    uint16 xc = x1 + r;
-    uint16 yc = y1 + r;
-    sint16 x = 0;
-    sint16 y = r;
-    int d = 1 - r;
-
-    while (1) {
-
-        grDrawHorizontalLine(sfc, xc-x, xc+x+1, yc+y+1, bgColor);
-        grDrawHorizontalLine(sfc, xc-x, xc+x+1, yc-y  , bgColor);
-
-        grDrawHorizontalLine(sfc, xc-y, xc+y+1, yc+x+1, bgColor);
-        grDrawHorizontalLine(sfc, xc-y, xc+y+1, yc-x  , bgColor);
-
-        if (y-x <= 1)
-            break;
-
-        if (d < 0)
-            d += (x << 1) + 3;
-        else {
-            d += ((x - y) << 1) + 5;
-            y--;
-        }
-
-        x++;
-    }
-
-    if (fgColor != bgColor) {
+    grDamageLayer(sfc, x1, y1, width, height);
 
-        x = 0;
-        y = r;
-        d = 1 - r;
+    fgColor = grColorMap[fgColor];
+    bgColor = grColorMap[bgColor];
 
-        while (1) {
+    if (grRecordDraw(sfc, DRAW_CIRCLE, x1, y1, x1 + width, y1 + height, fgColor, bgColor) != NULL)
+        return;
 
-            grPutPixel(sfc, xc-x  , yc+y+1, fgColor);
-            grPutPixel(sfc, xc+x+1, yc+y+1, fgColor);
+    grGetRaster(sfc, &raster);
+    grRasterCircle(&raster, x1, y1, width, fgColor, bgColor);
+}
 
-            grPutPixel(sfc, xc-x  , yc-y  , fgColor);
-            grPutPixel(sfc, xc+x+1, yc-y  , fgColor);
 
-            grPutPixel(sfc, xc-y  , yc+x+1, fgColor);
-            grPutPixel(sfc, xc+y+1, yc+x+1, fgColor);
+static void grDrawSpriteImage(PlatformSurface *sfc, struct TSpriteSheet *spriteSheet,
+                              struct TSprite *sprite, int x, int y, int flip)
+{
+    struct TRaster raster;
 
-            grPutPixel(sfc, xc-y  , yc-x  , fgColor);
-            grPutPixel(sfc, xc+y+1, yc-x  , fgColor);
+    if (flip && sprite->flippedPixels == NULL)
+        grFlipSpriteSheet(spriteSheet);
 
-            if (y-x <= 1)
-                break;
+    grDamageLayer(sfc, x, y, sprite->width, sprite->height);
 
-            if (d < 0)
-                d += (x << 1) + 3;
-            else {
-                d += ((x - y) << 1) + 5;
-                y--;
-            }
+    struct TDrawCommand *cmd = grRecordDraw(sfc, DRAW_SPRITE, x, y,
+                                            x + sprite->width, y + sprite->height, 0, 0);
 
-            x++;
-        }
+    // The list keeps the sheet from being evicted until it is dropped ;
+    // the TTM slot drawn from holds it too, so it can't be idle now
+    if (cmd != NULL) {
+        cmd->spriteSheet = spriteSheet;
+        cmd->sprite = sprite;
+        cmd->flip = flip;
+        spriteSheet->refCount++;
+        return;
     }
 
-    platformUnlockSurface(sfc);
+    grGetRaster(sfc, &raster);
+    grRasterSpans(&raster, spriteSheet, sprite, x, y, flip);
 }
 
 
 void grDrawSprite(PlatformSurface *sfc, struct TTtmSlot *ttmSlot, sint16 x, sint16 y, uint16 spriteNo, uint16 imageNo)
 {
-    if (spriteNo >= ttmSlot->numSprites[imageNo]) {
+    struct TSpriteSheet *spriteSheet = ttmSlot->spriteSheets[imageNo];
+
+    if (spriteSheet == NULL || spriteNo >= spriteSheet->numSprites) {
         fprintf(stderr, "Warning : grDrawSprite(): less than %d sprites loaded in slot %d\n", imageNo, spriteNo);
         return;
     }
 
     x += grDx; y += grDy;
 
-    PlatformSurface *srcSfc = ttmSlot->sprites[imageNo][spriteNo];
-
-    PlatformRect dest = { x, y, 0, 0 };
-    platformBlitSurface(srcSfc, NULL, sfc, &dest);
+    grDrawSpriteImage(sfc, spriteSheet, &spriteSheet->sprites[spriteNo], x, y, 0);
 }
 
 
 void grDrawSpriteFlip(PlatformSurface *sfc, struct TTtmSlot *ttmSlot, sint16 x, sint16 y, uint16 spriteNo, uint16 imageNo)
 {
-    if (spriteNo >= ttmSlot->numSprites[imageNo]) {
+    struct TSpriteSheet *spriteSheet = ttmSlot->spriteSheets[imageNo];
+
+    if (spriteSheet == NULL || spriteNo >= spriteSheet->numSprites) {
         fprintf(stderr, "Warning : grDrawSpriteFlip(): less than %d sprites loaded in slot %d\n", imageNo, spriteNo);
         return;
     }
 
     x += grDx; y += grDy;
 
-    PlatformSurface *srcSfc = ttmSlot->sprites[imageNo][spriteNo];
-    x += platformGetSurfaceWidth(srcSfc) - 1;
-
-    for (int i=0; i < platformGetSurfaceWidth(srcSfc); i++) {
-
-        PlatformRect src = { i, 0, 1, platformGetSurfaceHeight(srcSfc) };
-        PlatformRect dest = { x - i, y, 0, 0 };
-
-        platformBlitSurface(srcSfc, &src, sfc, &dest);
-    }
+    grDrawSpriteImage(sfc, spriteSheet, &spriteSheet->sprites[spriteNo], x, y, 1);
 }
 
 
@@ -500,10 +1978,32 @@ void grClearScreen(PlatformSurface *sfc)
 {
     PlatformRect rect;
 
+    // Only what was drawn since the last clear changes
+    struct TLayerExtent *extent = grFindLayerExtent(sfc);
+    struct TDisplayList *displayList = grFindDisplayList(sfc);
+
+    // Nothing was drawn into the layer itself
+    if (extent != NULL && displayList != NULL && !displayList->isMaterialized) {
+        grDamageDisplayList(displayList);
+        grDropDisplayList(displayList);
+        grResetLayerExtent(extent);
+        return;
+    }
+
+    grDamageLayerContents(sfc);
+
     platformGetClipRect(sfc, &rect);
     platformSetClipRect(sfc, NULL);
-    platformFillRect(sfc, NULL, 0xa8, 0, 0xa8, 0);
+
+    if (extent != NULL)
+        grClearLayerTiles(sfc, extent);
+    else
+        platformFillRectIndex(sfc, NULL, GR_TRANSPARENT);
+
     platformSetClipRect(sfc, &rect);
+
+    if (displayList != NULL)
+        grDropDisplayList(displayList);
 }
 
 
@@ -512,10 +2012,7 @@ void grLoadScreen(char *strArg)
     if (grBackgroundSfc != NULL)
         grReleaseScreen();
 
-    if (grSavedZonesLayer != NULL)
-        grReleaseSavedLayer();
-
-    struct TScrResource *scrResource = findScrResource(strArg);
+    struct TScrResource *scrResource = findScrResourceHeader(strArg);
 
     if ((scrResource->width % 2) == 1) {
         fprintf(stderr, "Warning: grLoadScreen(): can't manage odd widths\n");
@@ -528,18 +2025,10 @@ void grLoadScreen(char *strArg)
     uint16 width  = scrResource->width;
     uint16 height = scrResource->height;
 
-    uint8 *outData = safe_malloc(width * height * sizeof(uint32));
-
-    uint8 *inPtr  = scrResource->uncompressedData;
-    uint8 *outPtr = outData;
-
-    for (int inOffset=0; inOffset < width*height/2; inOffset++) {
-        memcpy(outPtr, ttmPalette[(inPtr[0] & 0xf0) >> 4] , 4); outPtr += 4;
-        memcpy(outPtr, ttmPalette[(inPtr[0] & 0x0f)     ] , 4); outPtr += 4;
-        inPtr++;
-    }
+    grBackgroundSfc = grNewBackground(width, height);
 
-    grBackgroundSfc = platformCreateSurfaceFrom((void*)outData, width, height, 4*width);
+    memcpy(grBackgroundPixels, grGetScreenCopy(scrResource), width * height);
+    grDamageAll();
 }
 
 
@@ -548,83 +2037,84 @@ void grInitEmptyBackground(void)
     if (grBackgroundSfc != NULL)
         grReleaseScreen();
 
-    if (grSavedZonesLayer != NULL)
-        grReleaseSavedLayer();
+    grBackgroundSfc = grNewBackground(SCREEN_WIDTH, SCREEN_HEIGHT);
 
-    uint8 *data = safe_malloc(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32));
-    memset(data, 0, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint32));
-    grBackgroundSfc = platformCreateSurfaceFrom((void*)data, SCREEN_WIDTH, SCREEN_HEIGHT, 4*SCREEN_WIDTH);
+    memset(grBackgroundPixels, GR_BLACK, SCREEN_WIDTH * SCREEN_HEIGHT);
+    grDamageAll();
 }
 
 
 void grReleaseBmp(struct TTtmSlot *ttmSlot, uint16 bmpSlotNo)
 {
-    for (int i=0; i < ttmSlot->numSprites[bmpSlotNo]; i++) {
-        free(platformGetSurfacePixels(ttmSlot->sprites[bmpSlotNo][i]));
-        platformFreeSurface(ttmSlot->sprites[bmpSlotNo][i]);
-    }
+    struct TSpriteSheet *spriteSheet = ttmSlot->spriteSheets[bmpSlotNo];
+
+    if (spriteSheet == NULL)
+        return;
 
-    ttmSlot->numSprites[bmpSlotNo] = 0;
+    ttmSlot->spriteSheets[bmpSlotNo] = NULL;
+    grUnrefSpriteSheet(spriteSheet);
 }
 
 
 void grLoadBmp(struct TTtmSlot *ttmSlot, uint16 slotNo, char *strArg)
 {
-    if (ttmSlot->numSprites[slotNo])
-        grReleaseBmp(ttmSlot, slotNo);
-
-    struct TBmpResource *bmpResource = findBmpResource(strArg);
-    uint8 *inPtr = bmpResource->uncompressedData;
+    struct TBmpResource *bmpResource = findBmpResourceHeader(strArg);
+    struct TSpriteSheet *spriteSheet = NULL;
 
-    ttmSlot->numSprites[slotNo] = bmpResource->numImages;
-
-    for (int image=0; image < bmpResource->numImages; image++) {
-
-        if ((bmpResource->widths[image] % 2) == 1)
-            fatalError("grLoadBmp(): can't manage odd widths");
+    for (int i=0; i < grNumSpriteSheets; i++) {
+        if (grSpriteSheets[i]->bmpResource == bmpResource) {
+            spriteSheet = grSpriteSheets[i];
+            break;
+        }
+    }
 
-        uint16 width  = bmpResource->widths[image];
-        uint16 height = bmpResource->heights[image];
+    if (spriteSheet == NULL) {
 
-        uint8 *outData = safe_malloc(width * height * sizeof(uint32));
+        // There can't be more sheets than BMP resources
+        if (grSpriteSheets == NULL)
+            grSpriteSheets = safe_malloc(numBmpResources * sizeof(struct TSpriteSheet *));
 
-        uint8 *outPtr = outData;
+        spriteSheet = grNewSpriteSheet(bmpResource);
+        grSpriteSheets[grNumSpriteSheets++] = spriteSheet;
+    }
+    else if (spriteSheet->refCount == 0) {
+        grIdleSpriteSheetsSize -= spriteSheet->pixelsSize;
+    }
 
-        for (int inOffset=0; inOffset < (width*height/2); inOffset++) {
-            memcpy(outPtr, ttmPalette[(inPtr[0] & 0xf0) >> 4] , 4); outPtr += 4;
-            memcpy(outPtr, ttmPalette[(inPtr[0] & 0x0f)     ] , 4); outPtr += 4;
-            inPtr++;
-        }
+    // Take the new reference first: reloading the same BMP
+    // in a slot must not let its sheet go idle
+    spriteSheet->refCount++;
+    spriteSheet->lastUsed = ++grSpriteSheetsClock;
 
-        PlatformSurface *surface = platformCreateSurfaceFrom((void*)outData,
-                                               width, height, 4*width);
-        platformSetColorKey(surface, 0xa8, 0, 0xa8);
-        ttmSlot->sprites[slotNo][image] = surface;
-    }
+    grReleaseBmp(ttmSlot, slotNo);
+    ttmSlot->spriteSheets[slotNo] = spriteSheet;
 }
 
 
 void grFadeOut(void)
 {
     static int fadeOutType = 0;
-    PlatformSurface *sfc = platformGetWindowSurface(platform_window);
+    PlatformSurface *sfc = grFrameSfc;
     PlatformSurface *tmpSfc = grNewLayer();
 
 
     grDx = grDy = 0;
 
+    // It is blitted to the frame as it gets drawn to
+    grMaterializeLayer(tmpSfc);
+
     switch (fadeOutType) {
 
         // Circle from center
         case 0:
-            // Note: we use tmpSfc to be sure we have a 32bpp surface,
+            // Note: we use tmpSfc to be sure we have an 8bpp surface,
             // which is needed by grDrawCircle()
             for (int radius=20; radius <= 400; radius += 20) {
                 grDrawCircle(tmpSfc, 320 - radius, 240 - radius,
                     radius << 1, radius << 1, 5, 5);
                 platformBlitSurface(tmpSfc, NULL, sfc, &grScreenOrigin);
                 eventsWaitTick(1);
-                platformUpdateWindow(platform_window);
+                grPresentFrame();
             }
             break;
 
@@ -633,7 +2123,7 @@ void grFadeOut(void)
             for (int i=1; i <= 20; i++) {
                 grDrawRect(sfc, grScreenOrigin.x + 320 - i*16, grScreenOrigin.y + 240 - i*12, i*32, i*24, 5);
                 eventsWaitTick(1);
-                platformUpdateWindow(platform_window);
+                grPresentFrame();
             }
             break;
 
@@ -642,7 +2132,7 @@ void grFadeOut(void)
             for (int i=600; i >= 0; i -= 40) {
                 grDrawRect(sfc, grScreenOrigin.x + i, grScreenOrigin.y, 40, 480, 5);
                 eventsWaitTick(1);
-                platformUpdateWindow(platform_window);
+                grPresentFrame();
             }
             break;
 
@@ -651,7 +2141,7 @@ void grFadeOut(void)
             for (int i=0; i < SCREEN_WIDTH; i += 40) {
                 grDrawRect(sfc, grScreenOrigin.x + i, grScreenOrigin.y, 40, SCREEN_HEIGHT, 5);
                 eventsWaitTick(1);
-                platformUpdateWindow(platform_window);
+                grPresentFrame();
             }
             break;
 
@@ -661,13 +2151,16 @@ void grFadeOut(void)
                 grDrawRect(sfc, grScreenOrigin.x + 320+i, grScreenOrigin.y, 20, SCREEN_HEIGHT, 5);
                 grDrawRect(sfc, grScreenOrigin.x + 300-i, grScreenOrigin.y, 20, SCREEN_HEIGHT, 5);
                 eventsWaitTick(1);
-                platformUpdateWindow(platform_window);
+                grPresentFrame();
             }
             break;
     }
 
     grFreeLayer(tmpSfc);
 
+    // The frame was drawn to directly, it has to be composed again
+    grDamageAll();
+
     fadeOutType = (fadeOutType + 1) % 5;
 }
 
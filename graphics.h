@@ -40,13 +40,38 @@ struct TAdsScene {
 };
 
 
+struct TSpriteSpan {       // a run of opaque pixels in a row of a sprite
+    uint16 x;
+    uint16 width;
+};
+
+struct TSprite {
+    uint16 width;
+    uint16 height;
+    uint8  *pixels;
+    uint8  *flippedPixels;  // mirrored copy of the pixels, once drawn flipped
+    uint32 *rows;           // spans of row y are spans[rows[y]] to spans[rows[y+1]-1]
+};
+
+struct TSpriteSheet {      // the expanded images of one BMP, shared by all TTM slots
+    struct TBmpResource *bmpResource;
+    int    refCount;
+    uint32 lastUsed;
+    uint32 pixelsSize;     // including the flipped copy, if any
+    uint8  *pixels;
+    uint8  *flippedPixels;
+    struct TSpriteSpan *spans;
+    uint32 *rows;
+    int    numSprites;
+    struct TSprite sprites[MAX_SPRITES_PER_BMP];
+};
+
 struct TTtmSlot {
     uint8       *data;
     uint32      dataSize;
     struct      TTtmTag *tags;
     int         numTags;
-    int         numSprites[MAX_BMP_SLOTS];
-    PlatformSurface *sprites[MAX_BMP_SLOTS][MAX_SPRITES_PER_BMP];
+    struct TSpriteSheet *spriteSheets[MAX_BMP_SLOTS];
 };
 
 struct TTtmTag {  // TODO : rename, used for ADS too
@@ -77,11 +102,15 @@ extern int grDx;
 extern int grDy;
 extern int grWindowed;
 extern int grUpdateDelay;
+extern int grComposeWorkers;
+extern int grLayersHighWater;
 
 
 void graphicsInit(void);
 void graphicsEnd(void);
 void grRefreshDisplay(void);
+void grSetComposeWorkers(int numWorkers);
+void grDamageAll(void);
 void grToggleFullScreen(void);
 void grUpdateDisplay(struct TTtmThread *ttmBackgroundThread,
                      struct TTtmThread *ttmThreads,
@@ -197,7 +197,10 @@ void islandAnimateClouds(struct TTtmThread *ttmThread) {
     grClearScreen(ttmThread->ttmLayer);
     if (islandState.clouds.numClouds > 0) {
         ttmThread->isRunning = 3;
-        grLoadBmp(ttmSlot, 0, "BACKGRND.BMP");
+
+        // Loaded once: the slot keeps the sheet, with its flipped copy
+        if (ttmSlot->spriteSheets[0] == NULL)
+            grLoadBmp(ttmSlot, 0, "BACKGRND.BMP");
 
         // animate clouds x position
         for (sint32 i=0; i < islandState.clouds.numClouds; i++) {
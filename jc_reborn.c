@@ -35,10 +35,12 @@
 #include "ttm.h"
 #include "ads.h"
 #include "story.h"
+#include "bench.h"
 
 
 static int  argDump     = 0;
 static int  argBench    = 0;
+static int  argBenchExpand = 0;
 static int  argTtm      = 0;
 static int  argAds      = 0;
 static int  argPlayAll  = 0;
@@ -57,6 +59,7 @@ static void usage(void)
         printf("         jc_reborn version\n");
         printf("         jc_reborn dump\n");
         printf("         jc_reborn [<options>] bench\n");
+        printf("         jc_reborn benchexpand\n");
         printf("         jc_reborn [<options>] ttm <TTM name>\n");
         printf("         jc_reborn [<options>] ads <ADS name> <ADS tag no>\n");
         printf("\n");
@@ -66,6 +69,9 @@ static void usage(void)
         printf("         island     - display the island as background for ADS play\n");
         printf("         debug      - print some debug info on stdout\n");
         printf("         hotkeys    - enable hot keys\n");
+        printf("         nopreload  - decode resources only when needed\n");
+        printf("         threads <n> - compose the screen with n threads\n");
+        printf("                      (default: one per CPU)\n");
         printf("\n");
         printf(" While-playing hot-keys (if enabled):\n");
         printf("         Esc        - Terminate immediately\n");
@@ -112,6 +118,9 @@ static void parseArgs(int argc, char **argv)
             else if (!strcmp(argv[i], "bench")) {
                 argBench = 1;
             }
+            else if (!strcmp(argv[i], "benchexpand")) {
+                argBenchExpand = 1;
+            }
             else if (!strcmp(argv[i], "ttm")) {
                 argTtm = 1;
                 numExpectedArgs = 1;
@@ -135,16 +144,24 @@ static void parseArgs(int argc, char **argv)
             else if (!strcmp(argv[i], "hotkeys")) {
                 evHotKeysEnabled = 1;
             }
+            else if (!strcmp(argv[i], "nopreload")) {
+                resPreloadDisabled = 1;
+            }
+            else if (!strcmp(argv[i], "threads")) {
+                if (++i == argc || atoi(argv[i]) < 1)
+                    usage();
+                grComposeWorkers = atoi(argv[i]);
+            }
         }
     }
 
     if (numExpectedArgs)
         usage();
 
-    if (argDump + argBench + argTtm + argAds > 1)
+    if (argDump + argBench + argBenchExpand + argTtm + argAds > 1)
         usage();
 
-    if (argDump + argBench + argTtm + argAds == 0)
+    if (argDump + argBench + argBenchExpand + argTtm + argAds == 0)
         argPlayAll = 1;
 }
 
@@ -178,6 +195,10 @@ int main(int argc, char **argv)
         graphicsEnd();
     }
 
+    else if (argBenchExpand) {
+        benchExpand();
+    }
+
     else if (argTtm) {
         graphicsInit();
         soundInit();
@@ -204,6 +225,9 @@ int main(int argc, char **argv)
         graphicsEnd();
     }
 
+    debugMsg("%d of %d resources materialized", numMaterializedResources,
+             numAdsResources + numBmpResources + numScrResources + numTtmResources);
+
     return 0;
 }
 
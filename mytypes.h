@@ -33,6 +33,7 @@ typedef uint32_t uint32;
 typedef int8_t   sint8;
 typedef int16_t  sint16;
 typedef int32_t  sint32;
+typedef int64_t  sint64;
 
 #endif // MYTYPES_H
 
@@ -33,6 +33,9 @@
 typedef struct PlatformSurface PlatformSurface;
 typedef struct PlatformWindow PlatformWindow;
 typedef struct PlatformRect PlatformRect;
+typedef struct PlatformThread PlatformThread;
+typedef struct PlatformMutex PlatformMutex;
+typedef struct PlatformCond PlatformCond;
 
 // Platform rectangle
 struct PlatformRect {
@@ -102,6 +105,15 @@ void platformFreeSurface(PlatformSurface* surface);
 void platformLockSurface(PlatformSurface* surface);
 void platformUnlockSurface(PlatformSurface* surface);
 
+// Graphics - Indexed surfaces: one byte color numbers, copied as they are
+// when blitted to another indexed surface, or converted through the source
+// palette when blitted to a 32bpp one. Their color key is a color number.
+PlatformSurface* platformCreateIndexedSurface(int width, int height);
+PlatformSurface* platformCreateIndexedSurfaceFrom(void* pixels, int width, int height, int pitch);
+void platformSetPaletteColor(PlatformSurface* surface, uint8 index, uint8 r, uint8 g, uint8 b);
+void platformSetColorKeyIndex(PlatformSurface* surface, uint8 index);
+void platformFillRectIndex(PlatformSurface* surface, PlatformRect* rect, uint8 index);
+
 // Graphics - Blitting and drawing
 void platformBlitSurface(PlatformSurface* src, PlatformRect* srcRect,
                         PlatformSurface* dst, PlatformRect* dstRect);
@@ -126,6 +138,22 @@ int platformPollEvent(PlatformEvent* event);
 uint32 platformGetTicks(void);
 void platformDelay(uint32 ms);
 
+// Threading - platformCreateThread() returns NULL where threads are
+// not available, callers are expected to do the work themselves then
+typedef void (*PlatformThreadFunc)(void* arg);
+
+PlatformThread* platformCreateThread(PlatformThreadFunc func, void* arg);
+void platformJoinThread(PlatformThread* thread);
+PlatformMutex* platformCreateMutex(void);
+void platformDestroyMutex(PlatformMutex* mutex);
+void platformLockMutex(PlatformMutex* mutex);
+void platformUnlockMutex(PlatformMutex* mutex);
+PlatformCond* platformCreateCond(void);
+void platformDestroyCond(PlatformCond* cond);
+void platformWaitCond(PlatformCond* cond, PlatformMutex* mutex);
+void platformBroadcastCond(PlatformCond* cond);
+int platformGetCPUCount(void);
+
 // Audio
 typedef void (*PlatformAudioCallback)(void* userdata, uint8* stream, int len);
 
@@ -6,6 +6,7 @@
 #ifdef PLATFORM_LINUX
 
 #include "platform.h"
+#include "utils.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -30,6 +31,8 @@ struct PlatformSurface {
     uint8* pixels;
     uint8 hasColorKey;
     uint8 colorKeyR, colorKeyG, colorKeyB;
+    uint8 colorKeyIndex;
+    uint32* palette;
     PlatformRect clipRect;
     int ownPixels;
 };
@@ -47,6 +50,172 @@ struct PlatformWindow {
 static PlatformWindow* mainWindow = NULL;
 
 // Initialize platform
+// Color keyed blitting: pixels matching the key are left out. The
+// vector kernels compare a whole register of pixels against the key,
+// and keep the destination pixels where the mask is set.
+#if defined(__x86_64__) || defined(__i386__)
+#define BLIT_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#define BLIT_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__)
+#define TARGET(x) __attribute__((target(x)))
+#else
+#define TARGET(x)
+#endif
+
+// 32bpp pixels are BGRA in memory: the key is 0x00RRGGBB, alpha is ignored
+#define KEY_RGB_MASK 0x00ffffff
+
+typedef void (*BlitKeyedRowFunc)(uint8* dst, const uint8* src, int w, uint32 key);
+
+static void blitKeyedRow8Scalar(uint8* dst, const uint8* src, int w, uint32 key) {
+    for (int x = 0; x < w; x++) {
+        if (src[x] != key) dst[x] = src[x];
+    }
+}
+
+static void blitKeyedRow32Scalar(uint8* dst, const uint8* src, int w, uint32 key) {
+    const uint32* srcPixels = (const uint32*)src;
+    uint32* dstPixels = (uint32*)dst;
+    
+    for (int x = 0; x < w; x++) {
+        if ((srcPixels[x] & KEY_RGB_MASK) != key) dstPixels[x] = srcPixels[x];
+    }
+}
+
+#ifdef BLIT_X86
+
+TARGET("sse2")
+static void blitKeyedRow8SSE2(uint8* dst, const uint8* src, int w, uint32 key) {
+    __m128i k = _mm_set1_epi8((char)key);
+    int x = 0;
+    
+    for (; x + 16 <= w; x += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + x));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + x));
+        __m128i m = _mm_cmpeq_epi8(s, k);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s)));
+    }
+    
+    blitKeyedRow8Scalar(dst + x, src + x, w - x, key);
+}
+
+TARGET("sse2")
+static void blitKeyedRow32SSE2(uint8* dst, const uint8* src, int w, uint32 key) {
+    __m128i k = _mm_set1_epi32((int)key);
+    __m128i rgb = _mm_set1_epi32(KEY_RGB_MASK);
+    int x = 0;
+    
+    for (; x + 4 <= w; x += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + x * 4));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + x * 4));
+        __m128i m = _mm_cmpeq_epi32(_mm_and_si128(s, rgb), k);
+        _mm_storeu_si128((__m128i*)(dst + x * 4), _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s)));
+    }
+    
+    blitKeyedRow32Scalar(dst + x * 4, src + x * 4, w - x, key);
+}
+
+TARGET("avx2")
+static void blitKeyedRow8AVX2(uint8* dst, const uint8* src, int w, uint32 key) {
+    __m256i k = _mm256_set1_epi8((char)key);
+    int x = 0;
+    
+    for (; x + 32 <= w; x += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + x));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + x));
+        __m256i m = _mm256_cmpeq_epi8(s, k);
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_blendv_epi8(s, d, m));
+    }
+    
+    blitKeyedRow8Scalar(dst + x, src + x, w - x, key);
+}
+
+TARGET("avx2")
+static void blitKeyedRow32AVX2(uint8* dst, const uint8* src, int w, uint32 key) {
+    // 32 bits lanes can be stored under a mask without reading the destination
+    __m256i k = _mm256_set1_epi32((int)key);
+    __m256i rgb = _mm256_set1_epi32(KEY_RGB_MASK);
+    __m256i ones = _mm256_set1_epi32(-1);
+    int x = 0;
+    
+    for (; x + 8 <= w; x += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + x * 4));
+        __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(s, rgb), k);
+        _mm256_maskstore_epi32((int*)(dst + x * 4), _mm256_xor_si256(m, ones), s);
+    }
+    
+    blitKeyedRow32Scalar(dst + x * 4, src + x * 4, w - x, key);
+}
+
+#endif // BLIT_X86
+
+#ifdef BLIT_NEON
+
+static void blitKeyedRow8NEON(uint8* dst, const uint8* src, int w, uint32 key) {
+    uint8x16_t k = vdupq_n_u8((uint8)key);
+    int x = 0;
+    
+    for (; x + 16 <= w; x += 16) {
+        uint8x16_t s = vld1q_u8(src + x);
+        uint8x16_t d = vld1q_u8(dst + x);
+        vst1q_u8(dst + x, vbslq_u8(vceqq_u8(s, k), d, s));
+    }
+    
+    blitKeyedRow8Scalar(dst + x, src + x, w - x, key);
+}
+
+static void blitKeyedRow32NEON(uint8* dst, const uint8* src, int w, uint32 key) {
+    uint32x4_t k = vdupq_n_u32(key);
+    uint32x4_t rgb = vdupq_n_u32(KEY_RGB_MASK);
+    int x = 0;
+    
+    for (; x + 4 <= w; x += 4) {
+        uint32x4_t s = vld1q_u32((const uint32*)(src + x * 4));
+        uint32x4_t d = vld1q_u32((const uint32*)(dst + x * 4));
+        vst1q_u32((uint32*)(dst + x * 4), vbslq_u32(vceqq_u32(vandq_u32(s, rgb), k), d, s));
+    }
+    
+    blitKeyedRow32Scalar(dst + x * 4, src + x * 4, w - x, key);
+}
+
+#endif // BLIT_NEON
+
+typedef struct {
+    const char* name;
+    uint32 cpuFeatures;
+    BlitKeyedRowFunc keyedRow8;
+    BlitKeyedRowFunc keyedRow32;
+} BlitKernel;
+
+// Fastest first
+static const BlitKernel blitKernels[] = {
+#ifdef BLIT_X86
+    { "avx2",   CPU_AVX2, blitKeyedRow8AVX2,   blitKeyedRow32AVX2   },
+    { "sse2",   CPU_SSE2, blitKeyedRow8SSE2,   blitKeyedRow32SSE2   },
+#endif
+#ifdef BLIT_NEON
+    { "neon",   CPU_NEON, blitKeyedRow8NEON,   blitKeyedRow32NEON   },
+#endif
+    { "scalar", 0,        blitKeyedRow8Scalar, blitKeyedRow32Scalar }
+};
+
+static const BlitKernel* blitKernel = &blitKernels[sizeof(blitKernels) / sizeof(blitKernels[0]) - 1];
+
+static void selectBlitKernel(void) {
+    uint32 features = getCpuFeatures();
+    int i = 0;
+    
+    while ((blitKernels[i].cpuFeatures & features) != blitKernels[i].cpuFeatures) i++;
+    
+    blitKernel = &blitKernels[i];
+    debugMsg("Using the %s blitting kernel", blitKernel->name);
+}
+
 int platformInit(void) {
     display = XOpenDisplay(NULL);
     if (!display) {
@@ -55,6 +224,7 @@ int platformInit(void) {
     }
     
     clock_gettime(CLOCK_MONOTONIC, &startTime);
+    selectBlitKernel();
     return 0;
 }
 
@@ -190,6 +360,7 @@ PlatformSurface* platformCreateSurface(int width, int height) {
     surface->pitch = width * 4;
     surface->pixels = (uint8*)calloc(width * height, 4);
     surface->hasColorKey = 0;
+    surface->palette = NULL;
     surface->clipRect.x = 0;
     surface->clipRect.y = 0;
     surface->clipRect.w = width;
@@ -206,6 +377,41 @@ PlatformSurface* platformCreateSurfaceFrom(void* pixels, int width, int height,
     surface->pitch = pitch;
     surface->pixels = (uint8*)pixels;
     surface->hasColorKey = 0;
+    surface->palette = NULL;
+    surface->clipRect.x = 0;
+    surface->clipRect.y = 0;
+    surface->clipRect.w = width;
+    surface->clipRect.h = height;
+    surface->ownPixels = 0;
+    return surface;
+}
+
+PlatformSurface* platformCreateIndexedSurface(int width, int height) {
+    PlatformSurface* surface = (PlatformSurface*)malloc(sizeof(PlatformSurface));
+    surface->width = width;
+    surface->height = height;
+    surface->bytesPerPixel = 1;
+    surface->pitch = width;
+    surface->pixels = (uint8*)calloc(width * height, 1);
+    surface->hasColorKey = 0;
+    surface->palette = NULL;
+    surface->clipRect.x = 0;
+    surface->clipRect.y = 0;
+    surface->clipRect.w = width;
+    surface->clipRect.h = height;
+    surface->ownPixels = 1;
+    return surface;
+}
+
+PlatformSurface* platformCreateIndexedSurfaceFrom(void* pixels, int width, int height, int pitch) {
+    PlatformSurface* surface = (PlatformSurface*)malloc(sizeof(PlatformSurface));
+    surface->width = width;
+    surface->height = height;
+    surface->bytesPerPixel = 1;
+    surface->pitch = pitch;
+    surface->pixels = (uint8*)pixels;
+    surface->hasColorKey = 0;
+    surface->palette = NULL;
     surface->clipRect.x = 0;
     surface->clipRect.y = 0;
     surface->clipRect.w = width;
@@ -219,6 +425,7 @@ void platformFreeSurface(PlatformSurface* surface) {
         if (surface->ownPixels && surface->pixels) {
             free(surface->pixels);
         }
+        free(surface->palette);
         free(surface);
     }
 }
@@ -232,6 +439,52 @@ void platformUnlockSurface(PlatformSurface* surface) {
 }
 
 // Blitting and drawing (same implementation as macOS)
+
+// Sources without a color key, to a destination of the same depth
+static void blitOpaque(PlatformSurface* src, int srcX, int srcY,
+                       PlatformSurface* dst, int dstX, int dstY, int w, int h) {
+    int rowBytes = w * src->bytesPerPixel;
+    uint8* srcRow = src->pixels + srcY * src->pitch + srcX * src->bytesPerPixel;
+    uint8* dstRow = dst->pixels + dstY * dst->pitch + dstX * dst->bytesPerPixel;
+    
+    // Whole rows of surfaces laid out alike make a single block
+    if (rowBytes == src->pitch && src->pitch == dst->pitch) {
+        memcpy(dstRow, srcRow, h * rowBytes);
+        return;
+    }
+    
+    for (int y = 0; y < h; y++) {
+        memcpy(dstRow, srcRow, rowBytes);
+        srcRow += src->pitch;
+        dstRow += dst->pitch;
+    }
+}
+
+// Indexed sources: color numbers are copied as they are to an indexed
+// destination, or looked up in the source palette for a 32bpp one
+static void blitIndexed(PlatformSurface* src, int srcX, int srcY,
+                        PlatformSurface* dst, int dstX, int dstY, int w, int h) {
+    if (dst->bytesPerPixel == 4 && !src->palette) return;
+    
+    for (int y = 0; y < h; y++) {
+        uint8* srcRow = src->pixels + (srcY + y) * src->pitch + srcX;
+        uint8* dstRow = dst->pixels + (dstY + y) * dst->pitch + dstX * dst->bytesPerPixel;
+        
+        if (dst->bytesPerPixel == 1) {
+            blitKernel->keyedRow8(dstRow, srcRow, w, src->colorKeyIndex);
+        } else {
+            uint32* dstPixels = (uint32*)dstRow;
+            if (!src->hasColorKey) {
+                for (int x = 0; x < w; x++) dstPixels[x] = src->palette[srcRow[x]];
+            } else {
+                for (int x = 0; x < w; x++) {
+                    if (srcRow[x] != src->colorKeyIndex) dstPixels[x] = src->palette[srcRow[x]];
+                }
+            }
+        }
+    }
+}
+
 void platformBlitSurface(PlatformSurface* src, PlatformRect* srcRect,
                         PlatformSurface* dst, PlatformRect* dstRect) {
     if (!src || !dst || !src->pixels || !dst->pixels) return;
@@ -262,32 +515,37 @@ void platformBlitSurface(PlatformSurface* src, PlatformRect* srcRect,
         srcH = dst->clipRect.y + dst->clipRect.h - dstY;
     }
     
+    // Clip to both surfaces, the rows need no checks after that
+    if (srcX < 0) { dstX -= srcX; srcW += srcX; srcX = 0; }
+    if (srcY < 0) { dstY -= srcY; srcH += srcY; srcY = 0; }
+    if (dstX < 0) { srcX -= dstX; srcW += dstX; dstX = 0; }
+    if (dstY < 0) { srcY -= dstY; srcH += dstY; dstY = 0; }
+    if (srcX + srcW > src->width) srcW = src->width - srcX;
+    if (srcY + srcH > src->height) srcH = src->height - srcY;
+    if (dstX + srcW > dst->width) srcW = dst->width - dstX;
+    if (dstY + srcH > dst->height) srcH = dst->height - dstY;
+    
     if (srcW <= 0 || srcH <= 0) return;
     
+    // Pick the variant once for the whole blit
+    if (!src->hasColorKey && src->bytesPerPixel == dst->bytesPerPixel) {
+        blitOpaque(src, srcX, srcY, dst, dstX, dstY, srcW, srcH);
+        return;
+    }
+    
+    if (src->bytesPerPixel == 1) {
+        blitIndexed(src, srcX, srcY, dst, dstX, dstY, srcW, srcH);
+        return;
+    }
+    
+    if (dst->bytesPerPixel != 4) return;
+    
+    uint32 key = (src->colorKeyR << 16) | (src->colorKeyG << 8) | src->colorKeyB;
+    
     for (int y = 0; y < srcH; y++) {
-        for (int x = 0; x < srcW; x++) {
-            int sx = srcX + x;
-            int sy = srcY + y;
-            int dx = dstX + x;
-            int dy = dstY + y;
-            
-            if (sx < 0 || sy < 0 || sx >= src->width || sy >= src->height) continue;
-            if (dx < 0 || dy < 0 || dx >= dst->width || dy >= dst->height) continue;
-            
-            uint8* srcPixel = src->pixels + sy * src->pitch + sx * src->bytesPerPixel;
-            uint8* dstPixel = dst->pixels + dy * dst->pitch + dx * dst->bytesPerPixel;
-            
-            // Check color key
-            if (src->hasColorKey) {
-                if (srcPixel[0] == src->colorKeyB &&
-                    srcPixel[1] == src->colorKeyG &&
-                    srcPixel[2] == src->colorKeyR) {
-                    continue;
-                }
-            }
-            
-            memcpy(dstPixel, srcPixel, 4);
-        }
+        uint8* srcRow = src->pixels + (srcY + y) * src->pitch + srcX * 4;
+        uint8* dstRow = dst->pixels + (dstY + y) * dst->pitch + dstX * 4;
+        blitKernel->keyedRow32(dstRow, srcRow, srcW, key);
     }
 }
 
@@ -311,6 +569,25 @@ void platformFillRect(PlatformSurface* surface, PlatformRect* rect,
     }
 }
 
+void platformFillRectIndex(PlatformSurface* surface, PlatformRect* rect, uint8 index) {
+    if (!surface || !surface->pixels) return;
+    
+    int x = rect ? rect->x : 0;
+    int y = rect ? rect->y : 0;
+    int w = rect ? rect->w : surface->width;
+    int h = rect ? rect->h : surface->height;
+    
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > surface->width) w = surface->width - x;
+    if (y + h > surface->height) h = surface->height - y;
+    if (w <= 0) return;
+    
+    for (int py = y; py < y + h; py++) {
+        memset(surface->pixels + py * surface->pitch + x, index, w);
+    }
+}
+
 void platformSetColorKey(PlatformSurface* surface, uint8 r, uint8 g, uint8 b) {
     if (surface) {
         surface->hasColorKey = 1;
@@ -320,6 +597,22 @@ void platformSetColorKey(PlatformSurface* surface, uint8 r, uint8 g, uint8 b) {
     }
 }
 
+void platformSetColorKeyIndex(PlatformSurface* surface, uint8 index) {
+    if (surface) {
+        surface->hasColorKey = 1;
+        surface->colorKeyIndex = index;
+    }
+}
+
+void platformSetPaletteColor(PlatformSurface* surface, uint8 index, uint8 r, uint8 g, uint8 b) {
+    if (surface) {
+        if (!surface->palette) {
+            surface->palette = (uint32*)calloc(256, sizeof(uint32));
+        }
+        surface->palette[index] = platformMapRGB(surface, r, g, b);
+    }
+}
+
 void platformSetClipRect(PlatformSurface* surface, PlatformRect* rect) {
     if (surface) {
         if (rect) {
@@ -428,6 +721,97 @@ void platformDelay(uint32 ms) {
     usleep(ms * 1000);
 }
 
+// Threading
+struct PlatformThread {
+    pthread_t thread;
+    PlatformThreadFunc func;
+    void* arg;
+};
+
+struct PlatformMutex {
+    pthread_mutex_t mutex;
+};
+
+struct PlatformCond {
+    pthread_cond_t cond;
+};
+
+static void* threadFunc(void* arg) {
+    PlatformThread* thread = (PlatformThread*)arg;
+    thread->func(thread->arg);
+    return NULL;
+}
+
+PlatformThread* platformCreateThread(PlatformThreadFunc func, void* arg) {
+    PlatformThread* thread = (PlatformThread*)malloc(sizeof(PlatformThread));
+    if (!thread) return NULL;
+
+    thread->func = func;
+    thread->arg = arg;
+
+    if (pthread_create(&thread->thread, NULL, threadFunc, thread) != 0) {
+        lastError = "Failed to create thread";
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+void platformJoinThread(PlatformThread* thread) {
+    if (thread) {
+        pthread_join(thread->thread, NULL);
+        free(thread);
+    }
+}
+
+PlatformMutex* platformCreateMutex(void) {
+    PlatformMutex* mutex = (PlatformMutex*)malloc(sizeof(PlatformMutex));
+    if (mutex) pthread_mutex_init(&mutex->mutex, NULL);
+    return mutex;
+}
+
+void platformDestroyMutex(PlatformMutex* mutex) {
+    if (mutex) {
+        pthread_mutex_destroy(&mutex->mutex);
+        free(mutex);
+    }
+}
+
+void platformLockMutex(PlatformMutex* mutex) {
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+void platformUnlockMutex(PlatformMutex* mutex) {
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+PlatformCond* platformCreateCond(void) {
+    PlatformCond* cond = (PlatformCond*)malloc(sizeof(PlatformCond));
+    if (cond) pthread_cond_init(&cond->cond, NULL);
+    return cond;
+}
+
+void platformDestroyCond(PlatformCond* cond) {
+    if (cond) {
+        pthread_cond_destroy(&cond->cond);
+        free(cond);
+    }
+}
+
+void platformWaitCond(PlatformCond* cond, PlatformMutex* mutex) {
+    pthread_cond_wait(&cond->cond, &mutex->mutex);
+}
+
+void platformBroadcastCond(PlatformCond* cond) {
+    pthread_cond_broadcast(&cond->cond);
+}
+
+int platformGetCPUCount(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
 // Audio
 static snd_pcm_t* pcmHandle = NULL;
 static PlatformAudioCallback audioCallback = NULL;
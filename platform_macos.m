@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <mach/mach_time.h>
 #include <AudioToolbox/AudioToolbox.h>
 #include <Cocoa/Cocoa.h>
@@ -26,6 +28,8 @@ struct PlatformSurface {
     uint8* pixels;
     uint8 hasColorKey;
     uint8 colorKeyR, colorKeyG, colorKeyB;
+    uint8 colorKeyIndex;
+    uint32* palette;
     PlatformRect clipRect;
     int ownPixels;  // 1 if we allocated pixels, 0 if external
 };
@@ -199,6 +203,7 @@ PlatformSurface* platformCreateSurface(int width, int height) {
     surface->pitch = width * 4;
     surface->pixels = (uint8*)calloc(width * height, 4);
     surface->hasColorKey = 0;
+    surface->palette = NULL;
     surface->clipRect.x = 0;
     surface->clipRect.y = 0;
     surface->clipRect.w = width;
@@ -215,6 +220,41 @@ PlatformSurface* platformCreateSurfaceFrom(void* pixels, int width, int height,
     surface->pitch = pitch;
     surface->pixels = (uint8*)pixels;
     surface->hasColorKey = 0;
+    surface->palette = NULL;
+    surface->clipRect.x = 0;
+    surface->clipRect.y = 0;
+    surface->clipRect.w = width;
+    surface->clipRect.h = height;
+    surface->ownPixels = 0;
+    return surface;
+}
+
+PlatformSurface* platformCreateIndexedSurface(int width, int height) {
+    PlatformSurface* surface = (PlatformSurface*)malloc(sizeof(PlatformSurface));
+    surface->width = width;
+    surface->height = height;
+    surface->bytesPerPixel = 1;
+    surface->pitch = width;
+    surface->pixels = (uint8*)calloc(width * height, 1);
+    surface->hasColorKey = 0;
+    surface->palette = NULL;
+    surface->clipRect.x = 0;
+    surface->clipRect.y = 0;
+    surface->clipRect.w = width;
+    surface->clipRect.h = height;
+    surface->ownPixels = 1;
+    return surface;
+}
+
+PlatformSurface* platformCreateIndexedSurfaceFrom(void* pixels, int width, int height, int pitch) {
+    PlatformSurface* surface = (PlatformSurface*)malloc(sizeof(PlatformSurface));
+    surface->width = width;
+    surface->height = height;
+    surface->bytesPerPixel = 1;
+    surface->pitch = pitch;
+    surface->pixels = (uint8*)pixels;
+    surface->hasColorKey = 0;
+    surface->palette = NULL;
     surface->clipRect.x = 0;
     surface->clipRect.y = 0;
     surface->clipRect.w = width;
@@ -228,6 +268,7 @@ void platformFreeSurface(PlatformSurface* surface) {
         if (surface->ownPixels && surface->pixels) {
             free(surface->pixels);
         }
+        free(surface->palette);
         free(surface);
     }
 }
@@ -241,6 +282,54 @@ void platformUnlockSurface(PlatformSurface* surface) {
 }
 
 // Blitting and drawing
+
+// Sources without a color key, to a destination of the same depth
+static void blitOpaque(PlatformSurface* src, int srcX, int srcY,
+                       PlatformSurface* dst, int dstX, int dstY, int w, int h) {
+    int rowBytes = w * src->bytesPerPixel;
+    uint8* srcRow = src->pixels + srcY * src->pitch + srcX * src->bytesPerPixel;
+    uint8* dstRow = dst->pixels + dstY * dst->pitch + dstX * dst->bytesPerPixel;
+    
+    // Whole rows of surfaces laid out alike make a single block
+    if (rowBytes == src->pitch && src->pitch == dst->pitch) {
+        memcpy(dstRow, srcRow, h * rowBytes);
+        return;
+    }
+    
+    for (int y = 0; y < h; y++) {
+        memcpy(dstRow, srcRow, rowBytes);
+        srcRow += src->pitch;
+        dstRow += dst->pitch;
+    }
+}
+
+// Indexed sources: color numbers are copied as they are to an indexed
+// destination, or looked up in the source palette for a 32bpp one
+static void blitIndexed(PlatformSurface* src, int srcX, int srcY,
+                        PlatformSurface* dst, int dstX, int dstY, int w, int h) {
+    if (dst->bytesPerPixel == 4 && !src->palette) return;
+    
+    for (int y = 0; y < h; y++) {
+        uint8* srcRow = src->pixels + (srcY + y) * src->pitch + srcX;
+        uint8* dstRow = dst->pixels + (dstY + y) * dst->pitch + dstX * dst->bytesPerPixel;
+        
+        if (dst->bytesPerPixel == 1) {
+            for (int x = 0; x < w; x++) {
+                if (srcRow[x] != src->colorKeyIndex) dstRow[x] = srcRow[x];
+            }
+        } else {
+            uint32* dstPixels = (uint32*)dstRow;
+            if (!src->hasColorKey) {
+                for (int x = 0; x < w; x++) dstPixels[x] = src->palette[srcRow[x]];
+            } else {
+                for (int x = 0; x < w; x++) {
+                    if (srcRow[x] != src->colorKeyIndex) dstPixels[x] = src->palette[srcRow[x]];
+                }
+            }
+        }
+    }
+}
+
 void platformBlitSurface(PlatformSurface* src, PlatformRect* srcRect,
                         PlatformSurface* dst, PlatformRect* dstRect) {
     if (!src || !dst || !src->pixels || !dst->pixels) return;
@@ -271,31 +360,40 @@ void platformBlitSurface(PlatformSurface* src, PlatformRect* srcRect,
         srcH = dst->clipRect.y + dst->clipRect.h - dstY;
     }
     
+    // Clip to both surfaces, the rows need no checks after that
+    if (srcX < 0) { dstX -= srcX; srcW += srcX; srcX = 0; }
+    if (srcY < 0) { dstY -= srcY; srcH += srcY; srcY = 0; }
+    if (dstX < 0) { srcX -= dstX; srcW += dstX; dstX = 0; }
+    if (dstY < 0) { srcY -= dstY; srcH += dstY; dstY = 0; }
+    if (srcX + srcW > src->width) srcW = src->width - srcX;
+    if (srcY + srcH > src->height) srcH = src->height - srcY;
+    if (dstX + srcW > dst->width) srcW = dst->width - dstX;
+    if (dstY + srcH > dst->height) srcH = dst->height - dstY;
+    
     if (srcW <= 0 || srcH <= 0) return;
     
+    // Pick the variant once for the whole blit
+    if (!src->hasColorKey && src->bytesPerPixel == dst->bytesPerPixel) {
+        blitOpaque(src, srcX, srcY, dst, dstX, dstY, srcW, srcH);
+        return;
+    }
+    
+    if (src->bytesPerPixel == 1) {
+        blitIndexed(src, srcX, srcY, dst, dstX, dstY, srcW, srcH);
+        return;
+    }
+    
+    if (dst->bytesPerPixel != 4) return;
+    
+    uint32 key = (src->colorKeyR << 16) | (src->colorKeyG << 8) | src->colorKeyB;
+    
     for (int y = 0; y < srcH; y++) {
+        uint8* srcRow = src->pixels + (srcY + y) * src->pitch + srcX * 4;
+        uint8* dstRow = dst->pixels + (dstY + y) * dst->pitch + dstX * 4;
+        uint32* srcPixels = (uint32*)srcRow;
+        uint32* dstPixels = (uint32*)dstRow;
         for (int x = 0; x < srcW; x++) {
-            int sx = srcX + x;
-            int sy = srcY + y;
-            int dx = dstX + x;
-            int dy = dstY + y;
-            
-            if (sx < 0 || sy < 0 || sx >= src->width || sy >= src->height) continue;
-            if (dx < 0 || dy < 0 || dx >= dst->width || dy >= dst->height) continue;
-            
-            uint8* srcPixel = src->pixels + sy * src->pitch + sx * src->bytesPerPixel;
-            uint8* dstPixel = dst->pixels + dy * dst->pitch + dx * dst->bytesPerPixel;
-            
-            // Check color key
-            if (src->hasColorKey) {
-                if (srcPixel[0] == src->colorKeyB &&
-                    srcPixel[1] == src->colorKeyG &&
-                    srcPixel[2] == src->colorKeyR) {
-                    continue;
-                }
-            }
-            
-            memcpy(dstPixel, srcPixel, 4);
+            if ((srcPixels[x] & 0x00ffffff) != key) dstPixels[x] = srcPixels[x];
         }
     }
 }
@@ -320,6 +418,25 @@ void platformFillRect(PlatformSurface* surface, PlatformRect* rect,
     }
 }
 
+void platformFillRectIndex(PlatformSurface* surface, PlatformRect* rect, uint8 index) {
+    if (!surface || !surface->pixels) return;
+    
+    int x = rect ? rect->x : 0;
+    int y = rect ? rect->y : 0;
+    int w = rect ? rect->w : surface->width;
+    int h = rect ? rect->h : surface->height;
+    
+    if (x < 0) { w += x; x = 0; }
+    if (y < 0) { h += y; y = 0; }
+    if (x + w > surface->width) w = surface->width - x;
+    if (y + h > surface->height) h = surface->height - y;
+    if (w <= 0) return;
+    
+    for (int py = y; py < y + h; py++) {
+        memset(surface->pixels + py * surface->pitch + x, index, w);
+    }
+}
+
 void platformSetColorKey(PlatformSurface* surface, uint8 r, uint8 g, uint8 b) {
     if (surface) {
         surface->hasColorKey = 1;
@@ -329,6 +446,22 @@ void platformSetColorKey(PlatformSurface* surface, uint8 r, uint8 g, uint8 b) {
     }
 }
 
+void platformSetColorKeyIndex(PlatformSurface* surface, uint8 index) {
+    if (surface) {
+        surface->hasColorKey = 1;
+        surface->colorKeyIndex = index;
+    }
+}
+
+void platformSetPaletteColor(PlatformSurface* surface, uint8 index, uint8 r, uint8 g, uint8 b) {
+    if (surface) {
+        if (!surface->palette) {
+            surface->palette = (uint32*)calloc(256, sizeof(uint32));
+        }
+        surface->palette[index] = platformMapRGB(surface, r, g, b);
+    }
+}
+
 void platformSetClipRect(PlatformSurface* surface, PlatformRect* rect) {
     if (surface) {
         if (rect) {
@@ -431,6 +564,97 @@ void platformDelay(uint32 ms) {
     usleep(ms * 1000);
 }
 
+// Threading
+struct PlatformThread {
+    pthread_t thread;
+    PlatformThreadFunc func;
+    void* arg;
+};
+
+struct PlatformMutex {
+    pthread_mutex_t mutex;
+};
+
+struct PlatformCond {
+    pthread_cond_t cond;
+};
+
+static void* threadFunc(void* arg) {
+    PlatformThread* thread = (PlatformThread*)arg;
+    thread->func(thread->arg);
+    return NULL;
+}
+
+PlatformThread* platformCreateThread(PlatformThreadFunc func, void* arg) {
+    PlatformThread* thread = (PlatformThread*)malloc(sizeof(PlatformThread));
+    if (!thread) return NULL;
+
+    thread->func = func;
+    thread->arg = arg;
+
+    if (pthread_create(&thread->thread, NULL, threadFunc, thread) != 0) {
+        lastError = "Failed to create thread";
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+void platformJoinThread(PlatformThread* thread) {
+    if (thread) {
+        pthread_join(thread->thread, NULL);
+        free(thread);
+    }
+}
+
+PlatformMutex* platformCreateMutex(void) {
+    PlatformMutex* mutex = (PlatformMutex*)malloc(sizeof(PlatformMutex));
+    if (mutex) pthread_mutex_init(&mutex->mutex, NULL);
+    return mutex;
+}
+
+void platformDestroyMutex(PlatformMutex* mutex) {
+    if (mutex) {
+        pthread_mutex_destroy(&mutex->mutex);
+        free(mutex);
+    }
+}
+
+void platformLockMutex(PlatformMutex* mutex) {
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+void platformUnlockMutex(PlatformMutex* mutex) {
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+PlatformCond* platformCreateCond(void) {
+    PlatformCond* cond = (PlatformCond*)malloc(sizeof(PlatformCond));
+    if (cond) pthread_cond_init(&cond->cond, NULL);
+    return cond;
+}
+
+void platformDestroyCond(PlatformCond* cond) {
+    if (cond) {
+        pthread_cond_destroy(&cond->cond);
+        free(cond);
+    }
+}
+
+void platformWaitCond(PlatformCond* cond, PlatformMutex* mutex) {
+    pthread_cond_wait(&cond->cond, &mutex->mutex);
+}
+
+void platformBroadcastCond(PlatformCond* cond) {
+    pthread_cond_broadcast(&cond->cond);
+}
+
+int platformGetCPUCount(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
 // Audio
 static AudioQueueRef audioQueue = NULL;
 static PlatformAudioCallback audioCallback = NULL;
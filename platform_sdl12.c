@@ -10,6 +10,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 static const char* lastError = "";
 static uint32 startTicks = 0;
@@ -22,6 +27,8 @@ struct PlatformSurface {
     uint8* pixels;
     uint8 hasColorKey;
     uint8 colorKeyR, colorKeyG, colorKeyB;
+    uint8 colorKeyIndex;
+    uint32* palette;
     PlatformRect clipRect;
     int ownPixels;
 };
@@ -174,8 +181,13 @@ void platformUpdateWindow(PlatformWindow* window) {
     uint8* dst = (uint8*)screen->pixels;
     uint8* src = surface->pixels;
 
-    for (int y = 0; y < surface->height; y++) {
-        memcpy(dst + y * screen->pitch, src + y * surface->pitch, rowBytes);
+    // Without padding on either side, the frame is a single block
+    if (screen->pitch == rowBytes && surface->pitch == rowBytes) {
+        memcpy(dst, src, surface->height * rowBytes);
+    } else {
+        for (int y = 0; y < surface->height; y++) {
+            memcpy(dst + y * screen->pitch, src + y * surface->pitch, rowBytes);
+        }
     }
 
     if (SDL_MUSTLOCK(screen)) {
@@ -201,6 +213,7 @@ PlatformSurface* platformCreateSurface(int width, int height) {
     surface->pitch = width * 4;
     surface->pixels = (uint8*)calloc(width * height, 4);
     surface->hasColorKey = 0;
+    surface->palette = NULL;
     surface->clipRect.x = 0;
     surface->clipRect.y = 0;
     surface->clipRect.w = width;
@@ -221,6 +234,49 @@ PlatformSurface* platformCreateSurfaceFrom(void* pixels, int width, int height,
     surface->pitch = pitch;
     surface->pixels = (uint8*)pixels;
     surface->hasColorKey = 0;
+    surface->palette = NULL;
+    surface->clipRect.x = 0;
+    surface->clipRect.y = 0;
+    surface->clipRect.w = width;
+    surface->clipRect.h = height;
+    surface->ownPixels = 0;
+    return surface;
+}
+
+PlatformSurface* platformCreateIndexedSurface(int width, int height) {
+    PlatformSurface* surface = (PlatformSurface*)malloc(sizeof(PlatformSurface));
+    if (!surface) {
+        return NULL;
+    }
+
+    surface->width = width;
+    surface->height = height;
+    surface->bytesPerPixel = 1;
+    surface->pitch = width;
+    surface->pixels = (uint8*)calloc(width * height, 1);
+    surface->hasColorKey = 0;
+    surface->palette = NULL;
+    surface->clipRect.x = 0;
+    surface->clipRect.y = 0;
+    surface->clipRect.w = width;
+    surface->clipRect.h = height;
+    surface->ownPixels = 1;
+    return surface;
+}
+
+PlatformSurface* platformCreateIndexedSurfaceFrom(void* pixels, int width, int height, int pitch) {
+    PlatformSurface* surface = (PlatformSurface*)malloc(sizeof(PlatformSurface));
+    if (!surface) {
+        return NULL;
+    }
+
+    surface->width = width;
+    surface->height = height;
+    surface->bytesPerPixel = 1;
+    surface->pitch = pitch;
+    surface->pixels = (uint8*)pixels;
+    surface->hasColorKey = 0;
+    surface->palette = NULL;
     surface->clipRect.x = 0;
     surface->clipRect.y = 0;
     surface->clipRect.w = width;
@@ -237,6 +293,7 @@ void platformFreeSurface(PlatformSurface* surface) {
     if (surface->ownPixels && surface->pixels) {
         free(surface->pixels);
     }
+    free(surface->palette);
     free(surface);
 }
 
@@ -248,6 +305,61 @@ void platformUnlockSurface(PlatformSurface* surface) {
     (void)surface;
 }
 
+// Sources without a color key, to a destination of the same depth
+static void blitOpaque(PlatformSurface* src, int srcX, int srcY,
+                       PlatformSurface* dst, int dstX, int dstY, int w, int h) {
+    int rowBytes = w * src->bytesPerPixel;
+    uint8* srcRow = src->pixels + srcY * src->pitch + srcX * src->bytesPerPixel;
+    uint8* dstRow = dst->pixels + dstY * dst->pitch + dstX * dst->bytesPerPixel;
+
+    // Whole rows of surfaces laid out alike make a single block
+    if (rowBytes == src->pitch && src->pitch == dst->pitch) {
+        memcpy(dstRow, srcRow, h * rowBytes);
+        return;
+    }
+
+    for (int y = 0; y < h; y++) {
+        memcpy(dstRow, srcRow, rowBytes);
+        srcRow += src->pitch;
+        dstRow += dst->pitch;
+    }
+}
+
+// Indexed sources: color numbers are copied as they are to an indexed
+// destination, or looked up in the source palette for a 32bpp one
+static void blitIndexed(PlatformSurface* src, int srcX, int srcY,
+                        PlatformSurface* dst, int dstX, int dstY, int w, int h) {
+    if (dst->bytesPerPixel == 4 && !src->palette) {
+        return;
+    }
+
+    for (int y = 0; y < h; y++) {
+        uint8* srcRow = src->pixels + (srcY + y) * src->pitch + srcX;
+        uint8* dstRow = dst->pixels + (dstY + y) * dst->pitch + dstX * dst->bytesPerPixel;
+
+        if (dst->bytesPerPixel == 1) {
+            for (int x = 0; x < w; x++) {
+                if (srcRow[x] != src->colorKeyIndex) {
+                    dstRow[x] = srcRow[x];
+                }
+            }
+        } else {
+            uint32* dstPixels = (uint32*)dstRow;
+            if (!src->hasColorKey) {
+                for (int x = 0; x < w; x++) {
+                    dstPixels[x] = src->palette[srcRow[x]];
+                }
+            } else {
+                for (int x = 0; x < w; x++) {
+                    if (srcRow[x] != src->colorKeyIndex) {
+                        dstPixels[x] = src->palette[srcRow[x]];
+                    }
+                }
+            }
+        }
+    }
+}
+
 void platformBlitSurface(PlatformSurface* src, PlatformRect* srcRect,
                         PlatformSurface* dst, PlatformRect* dstRect) {
     if (!src || !dst || !src->pixels || !dst->pixels) {
@@ -279,36 +391,69 @@ void platformBlitSurface(PlatformSurface* src, PlatformRect* srcRect,
         srcH = dst->clipRect.y + dst->clipRect.h - dstY;
     }
 
+    // Clip to both surfaces, the rows need no checks after that
+    if (srcX < 0) {
+        dstX -= srcX;
+        srcW += srcX;
+        srcX = 0;
+    }
+    if (srcY < 0) {
+        dstY -= srcY;
+        srcH += srcY;
+        srcY = 0;
+    }
+    if (dstX < 0) {
+        srcX -= dstX;
+        srcW += dstX;
+        dstX = 0;
+    }
+    if (dstY < 0) {
+        srcY -= dstY;
+        srcH += dstY;
+        dstY = 0;
+    }
+    if (srcX + srcW > src->width) {
+        srcW = src->width - srcX;
+    }
+    if (srcY + srcH > src->height) {
+        srcH = src->height - srcY;
+    }
+    if (dstX + srcW > dst->width) {
+        srcW = dst->width - dstX;
+    }
+    if (dstY + srcH > dst->height) {
+        srcH = dst->height - dstY;
+    }
+
     if (srcW <= 0 || srcH <= 0) {
         return;
     }
 
-    for (int y = 0; y < srcH; y++) {
-        for (int x = 0; x < srcW; x++) {
-            int sx = srcX + x;
-            int sy = srcY + y;
-            int dx = dstX + x;
-            int dy = dstY + y;
+    // Pick the variant once for the whole blit
+    if (!src->hasColorKey && src->bytesPerPixel == dst->bytesPerPixel) {
+        blitOpaque(src, srcX, srcY, dst, dstX, dstY, srcW, srcH);
+        return;
+    }
 
-            if (sx < 0 || sy < 0 || sx >= src->width || sy >= src->height) {
-                continue;
-            }
-            if (dx < 0 || dy < 0 || dx >= dst->width || dy >= dst->height) {
-                continue;
-            }
+    if (src->bytesPerPixel == 1) {
+        blitIndexed(src, srcX, srcY, dst, dstX, dstY, srcW, srcH);
+        return;
+    }
 
-            uint8* srcPixel = src->pixels + sy * src->pitch + sx * src->bytesPerPixel;
-            uint8* dstPixel = dst->pixels + dy * dst->pitch + dx * dst->bytesPerPixel;
+    if (dst->bytesPerPixel != 4) {
+        return;
+    }
 
-            if (src->hasColorKey) {
-                if (srcPixel[0] == src->colorKeyB &&
-                    srcPixel[1] == src->colorKeyG &&
-                    srcPixel[2] == src->colorKeyR) {
-                    continue;
-                }
-            }
+    uint32 key = (src->colorKeyR << 16) | (src->colorKeyG << 8) | src->colorKeyB;
+
+    for (int y = 0; y < srcH; y++) {
+        uint32* srcPixels = (uint32*)(src->pixels + (srcY + y) * src->pitch + srcX * 4);
+        uint32* dstPixels = (uint32*)(dst->pixels + (dstY + y) * dst->pitch + dstX * 4);
 
-            memcpy(dstPixel, srcPixel, 4);
+        for (int x = 0; x < srcW; x++) {
+            if ((srcPixels[x] & 0x00ffffff) != key) {
+                dstPixels[x] = srcPixels[x];
+            }
         }
     }
 }
@@ -335,6 +480,38 @@ void platformFillRect(PlatformSurface* surface, PlatformRect* rect,
     }
 }
 
+void platformFillRectIndex(PlatformSurface* surface, PlatformRect* rect, uint8 index) {
+    if (!surface || !surface->pixels) {
+        return;
+    }
+
+    int x = rect ? rect->x : 0;
+    int y = rect ? rect->y : 0;
+    int w = rect ? rect->w : surface->width;
+    int h = rect ? rect->h : surface->height;
+
+    if (x < 0) {
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (x + w > surface->width) {
+        w = surface->width - x;
+    }
+    if (y + h > surface->height) {
+        h = surface->height - y;
+    }
+
+    for (int py = y; py < y + h; py++) {
+        if (w > 0) {
+            memset(surface->pixels + py * surface->pitch + x, index, w);
+        }
+    }
+}
+
 void platformSetColorKey(PlatformSurface* surface, uint8 r, uint8 g, uint8 b) {
     if (!surface) {
         return;
@@ -346,6 +523,30 @@ void platformSetColorKey(PlatformSurface* surface, uint8 r, uint8 g, uint8 b) {
     surface->colorKeyB = b;
 }
 
+void platformSetColorKeyIndex(PlatformSurface* surface, uint8 index) {
+    if (!surface) {
+        return;
+    }
+
+    surface->hasColorKey = 1;
+    surface->colorKeyIndex = index;
+}
+
+void platformSetPaletteColor(PlatformSurface* surface, uint8 index, uint8 r, uint8 g, uint8 b) {
+    if (!surface) {
+        return;
+    }
+
+    if (!surface->palette) {
+        surface->palette = (uint32*)calloc(256, sizeof(uint32));
+        if (!surface->palette) {
+            return;
+        }
+    }
+
+    surface->palette[index] = platformMapRGB(surface, r, g, b);
+}
+
 void platformSetClipRect(PlatformSurface* surface, PlatformRect* rect) {
     if (!surface) {
         return;
@@ -439,6 +640,105 @@ void platformDelay(uint32 ms) {
     SDL_Delay(ms);
 }
 
+// Threading
+struct PlatformThread {
+    SDL_Thread* thread;
+    PlatformThreadFunc func;
+    void* arg;
+};
+
+struct PlatformMutex {
+    SDL_mutex* mutex;
+};
+
+struct PlatformCond {
+    SDL_cond* cond;
+};
+
+static int threadFunc(void* arg) {
+    PlatformThread* thread = (PlatformThread*)arg;
+    thread->func(thread->arg);
+    return 0;
+}
+
+PlatformThread* platformCreateThread(PlatformThreadFunc func, void* arg) {
+    PlatformThread* thread = (PlatformThread*)malloc(sizeof(PlatformThread));
+    if (!thread) return NULL;
+
+    thread->func = func;
+    thread->arg = arg;
+    thread->thread = SDL_CreateThread(threadFunc, thread);
+
+    if (!thread->thread) {
+        lastError = SDL_GetError();
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+void platformJoinThread(PlatformThread* thread) {
+    if (thread) {
+        SDL_WaitThread(thread->thread, NULL);
+        free(thread);
+    }
+}
+
+PlatformMutex* platformCreateMutex(void) {
+    PlatformMutex* mutex = (PlatformMutex*)malloc(sizeof(PlatformMutex));
+    if (mutex) mutex->mutex = SDL_CreateMutex();
+    return mutex;
+}
+
+void platformDestroyMutex(PlatformMutex* mutex) {
+    if (mutex) {
+        SDL_DestroyMutex(mutex->mutex);
+        free(mutex);
+    }
+}
+
+void platformLockMutex(PlatformMutex* mutex) {
+    SDL_mutexP(mutex->mutex);
+}
+
+void platformUnlockMutex(PlatformMutex* mutex) {
+    SDL_mutexV(mutex->mutex);
+}
+
+PlatformCond* platformCreateCond(void) {
+    PlatformCond* cond = (PlatformCond*)malloc(sizeof(PlatformCond));
+    if (cond) cond->cond = SDL_CreateCond();
+    return cond;
+}
+
+void platformDestroyCond(PlatformCond* cond) {
+    if (cond) {
+        SDL_DestroyCond(cond->cond);
+        free(cond);
+    }
+}
+
+void platformWaitCond(PlatformCond* cond, PlatformMutex* mutex) {
+    SDL_CondWait(cond->cond, mutex->mutex);
+}
+
+void platformBroadcastCond(PlatformCond* cond) {
+    SDL_CondBroadcast(cond->cond);
+}
+
+int platformGetCPUCount(void) {
+    // SDL 1.2 has no way to query this
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
 static int ensureAudioInitialized(void) {
     if (!(SDL_WasInit(SDL_INIT_AUDIO) & SDL_INIT_AUDIO)) {
         if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
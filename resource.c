@@ -29,310 +29,566 @@
 #include "utils.h"
 #include "resource.h"
 #include "uncompress.h"
+#include "expand.h"
+#include "platform.h"
+#include "cache.h"
 
-#define MAX_ADS_RESOURCES 100
-#define MAX_BMP_RESOURCES 200
-#define MAX_PAL_RESOURCES 1
-#define MAX_SCR_RESOURCES 20
-#define MAX_TTM_RESOURCES 100
+#define MAX_DECODE_WORKERS  4
+#define CACHE_FILENAME      "data/jc_reborn.jcache"
 
+#define DECODE_PENDING      0
+#define DECODE_RUNNING      1
+#define DECODE_DONE         2
 
-struct TAdsResource *adsResources[MAX_ADS_RESOURCES];
-struct TBmpResource *bmpResources[MAX_BMP_RESOURCES];
-struct TPalResource *palResources[MAX_PAL_RESOURCES];
-struct TScrResource *scrResources[MAX_SCR_RESOURCES];
-struct TTtmResource *ttmResources[MAX_TTM_RESOURCES];
+
+struct TDecodeJob {
+    char   *resName;
+    uint8  *compressedData;
+    uint8  compressionMethod;
+    uint32 compressedSize;
+    uint32 uncompressedSize;
+    uint8  **uncompressedData;
+    int    state;
+    int    isPixels;    // BMP or SCR, expanded straight from compressedData
+    int    isExpanded;  // decoded at least once by expandPayload()
+};
+
+
+
+struct TAdsResource **adsResources = NULL;
+struct TBmpResource **bmpResources = NULL;
+struct TPalResource **palResources = NULL;
+struct TScrResource **scrResources = NULL;
+struct TTtmResource **ttmResources = NULL;
 int numAdsResources = 0;
 int numBmpResources = 0;
 int numPalResources = 0;
 int numScrResources = 0;
 int numTtmResources = 0;
+int numMaterializedResources = 0;
+int resPreloadDisabled = 0;
 
 static struct TMapFile mapFile;
 
+static uint8  *mapFileData = NULL;
+static uint32 mapFileSize  = 0;
+static uint8  *resFileData = NULL;
+static uint32 resFileSize  = 0;
+
+// Perfect hash index of the resources names, built once all the
+// resources are known (hash and displace: a first hash picks a bucket,
+// whose displacement value either gives the slot directly or seeds
+// a second hash which is collision-free for the keys of that bucket)
+static int    *resIndexDisplacements = NULL;
+static uint16 *resIndexSlots = NULL;
+static uint32 resIndexSize = 0;
+
+// Compressed payloads are decoded by a pool of worker threads, in the
+// order of decodeQueue[] - a lookup for a payload which is still
+// pending decodes it on the spot, and one for a payload which is being
+// decoded by a worker waits for that payload only. BMP and SCR payloads
+// are left out: they are decoded and expanded in one pass when their
+// pixels are needed, never going through a 4bpp buffer.
+static struct TDecodeJob *decodeJobs = NULL;
+static int    *decodeQueue = NULL;
+static int    numDecodeJobs = 0;
+static int    numQueuedJobs = 0;
+static int    nextQueuedJob = 0;
+static int    decodeQuit = 0;
+static PlatformMutex *decodeMutex = NULL;
+static PlatformCond  *decodeCond = NULL;
+static PlatformThread *decodeWorkers[MAX_DECODE_WORKERS];
+static int    numDecodeWorkers = 0;
+
+
+static void checkSize(uint32 offset, uint32 numBytes, uint32 dataSize, char *resType)
+{
+    // Called before reading numBytes at offset: as offset never
+    // goes past dataSize, the difference can't wrap around
+    if (numBytes > dataSize - offset)
+        fatalError("%s resource is truncated", resType);
+}
+
 
-static struct TAdsResource *parseAdsResource(FILE *f)
+static void parseMagic(uint8 *data, uint32 *offset, uint32 dataSize, char *magic, char *resType)
 {
-    struct TAdsResource *adsResource;
-    uint8 *buffer;
+    checkSize(*offset, 4, dataSize, resType);
 
+    if (memcmp(data + *offset, magic, 4))
+        fatalError("'%s' string not found while parsing %s resource", magic, resType);
 
-    adsResource = safe_malloc(sizeof(struct TAdsResource));
+    *offset += 4;
+}
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"VER:",4))
-        fatalError("'VER:' string not found while parsing ADS resource");
 
-    free(buffer);
+static char *parseString(uint8 *data, uint32 *offset, uint32 dataSize, int maxlen)
+{
+    // The terminating zero must lie within the resource too
+    if (dataSize - *offset < (uint32) maxlen)
+        maxlen = dataSize - *offset;
 
-    adsResource->versionSize = readUint32(f);
-    adsResource->versionString = readUint8Block(f,5);
+    return peekString(data, offset, maxlen);
+}
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"ADS:",4))
-        fatalError("'ADS:' string not found while parsing ADS resource");
 
-    free(buffer);
+static uint8 *parseCompressedData(uint8 *data, uint32 *offset, uint32 dataSize,
+                                  uint32 *compressedSize, uint8 *compressionMethod,
+                                  uint32 *uncompressedSize)
+{
+    uint8 *result;
 
-    adsResource->adsUnknown1 = readUint8(f);
-    adsResource->adsUnknown2 = readUint8(f);
-    adsResource->adsUnknown3 = readUint8(f);
-    adsResource->adsUnknown4 = readUint8(f);
+    if (dataSize - *offset < 9)
+        fatalError("compressed data header exceeds the resource boundaries");
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"RES:",4))
-        fatalError("'RES:' string not found while parsing ADS resource");
+    *compressedSize    = peekUint32(data, offset) - 5; // discard size of compressionmethod+uncompressedsize
+    *compressionMethod = peekUint8(data, offset);
+    *uncompressedSize  = peekUint32(data, offset);
 
-    free(buffer);
+    if (*compressedSize > dataSize - *offset)
+        fatalError("compressed data exceeds the resource boundaries");
 
-    adsResource->resSize = readUint32(f);
-    adsResource->numRes = readUint16(f);
+    // Decompression is deferred until the resource is first looked up
+    result = data + *offset;
 
-    adsResource->res = safe_malloc(adsResource->numRes * sizeof(struct TAdsRes));
+    *offset += *compressedSize;
 
-    for (int i=0; i < adsResource->numRes; i++) {
-        adsResource->res[i].id = readUint16(f);
-        adsResource->res[i].name = getString(f,40);
+    return result;
+}
+
+
+static int newDecodeJob(char *resName, uint8 *compressedData,
+                        uint8 compressionMethod, uint32 compressedSize,
+                        uint32 uncompressedSize, uint8 **uncompressedData)
+{
+    struct TDecodeJob *job = &decodeJobs[numDecodeJobs];
+
+    job->resName           = resName;
+    job->compressedData    = compressedData;
+    job->compressionMethod = compressionMethod;
+    job->compressedSize    = compressedSize;
+    job->uncompressedSize  = uncompressedSize;
+    job->uncompressedData  = uncompressedData;
+    job->state             = DECODE_PENDING;
+    job->isPixels          = 0;
+    job->isExpanded        = 0;
+
+    // Payloads decoded by a previous run are used in place
+    uint8 *cachedData = cacheFind(resName, CACHE_PAYLOAD, uncompressedSize);
+
+    if (cachedData != NULL) {
+        *uncompressedData = cachedData;
+        job->state = DECODE_DONE;
     }
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"SCR:",4))
-        fatalError("'SCR:' string not found while parsing ADS resource");
+    return numDecodeJobs++;
+}
 
-    free(buffer);
 
-    adsResource->compressedSize = readUint32(f) - 5;
-    adsResource->compressionMethod = readUint8(f);
-    adsResource->uncompressedSize = readUint32(f);
+static void runDecodeJob(struct TDecodeJob *job)
+{
+    // Called with decodeMutex held, released while decoding
+    uint8 *data;
 
-    adsResource->uncompressedData = uncompress(f,
-                                      adsResource->compressionMethod,
-                                      adsResource->compressedSize,
-                                      adsResource->uncompressedSize
-                                    );
+    job->state = DECODE_RUNNING;
+    platformUnlockMutex(decodeMutex);
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"TAG:",4))
-        fatalError("'TAG:' string not found while parsing ADS resource");
+    data = uncompress(job->compressedData, job->compressionMethod,
+                      job->compressedSize, job->uncompressedSize);
 
-    free(buffer);
+    if (data != NULL)
+        cacheAdd(job->resName, CACHE_PAYLOAD, data, job->uncompressedSize);
 
-    adsResource->tagSize = readUint32(f);
-    adsResource->numTags = readUint16(f);
+    platformLockMutex(decodeMutex);
+    *job->uncompressedData = data;
+    job->state = DECODE_DONE;
+    numMaterializedResources++;
+    platformBroadcastCond(decodeCond);
 
-    adsResource->tags = safe_malloc(adsResource->numTags * sizeof(struct TTags));
+    debugMsg("Decompressed %s (%d resources materialized)",
+             job->resName, numMaterializedResources);
+}
 
-    for (int i=0; i < adsResource->numTags; i++) {
-        adsResource->tags[i].id = readUint16(f);
-        adsResource->tags[i].description = getString(f,40);
+
+static void materializeData(int jobNo)
+{
+    struct TDecodeJob *job = &decodeJobs[jobNo];
+
+    platformLockMutex(decodeMutex);
+
+    if (job->state == DECODE_PENDING)
+        runDecodeJob(job);
+
+    while (job->state != DECODE_DONE)
+        platformWaitCond(decodeCond, decodeMutex);
+
+    platformUnlockMutex(decodeMutex);
+}
+
+
+static void expandPayload(int jobNo, uint8 colorMap[16],
+                          uint8 *outPixels, uint32 numPixels)
+{
+    struct TDecodeJob *job = &decodeJobs[jobNo];
+    uint32 numBytes = numPixels / 2;
+    int isDecoded;
+
+    // Only materializeData() may decode it to 4bpp meanwhile
+    platformLockMutex(decodeMutex);
+
+    while (job->state == DECODE_RUNNING)
+        platformWaitCond(decodeCond, decodeMutex);
+
+    isDecoded = (job->state == DECODE_DONE);
+
+    if (!isDecoded && !job->isExpanded) {
+        job->isExpanded = 1;
+        numMaterializedResources++;
     }
 
-    return adsResource;
+    platformUnlockMutex(decodeMutex);
+
+    if (numBytes > job->uncompressedSize) {
+        memset(outPixels, 0, numPixels);
+        numBytes = job->uncompressedSize;
+    }
+
+    if (numBytes == 0)
+        return;
+
+    // A payload already decoded, by a previous run or for the 'dump'
+    // mode, is only expanded ; otherwise it is decoded and expanded in one pass,
+    // without going through the 4bpp buffer
+    if (isDecoded)
+        expandPixels(*job->uncompressedData, numBytes, colorMap, outPixels);
+    else
+        uncompressExpand(job->compressedData, job->compressionMethod,
+                         job->compressedSize, numBytes, colorMap, outPixels);
 }
 
 
-static struct TBmpResource *parseBmpResource(FILE *f)
+static void decodeQueuedJobs(void)
 {
-    struct TBmpResource *bmpResource;
-    uint8 *buffer;
+    platformLockMutex(decodeMutex);
 
+    while (nextQueuedJob < numQueuedJobs && !decodeQuit) {
 
-    bmpResource = safe_malloc(sizeof(struct TBmpResource));
+        struct TDecodeJob *job = &decodeJobs[decodeQueue[nextQueuedJob++]];
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"BMP:",4))
-        fatalError("'BMP:' string not found while parsing BMP resource");
+        if (job->state == DECODE_PENDING)
+            runDecodeJob(job);
+    }
 
-    free(buffer);
+    platformUnlockMutex(decodeMutex);
+}
 
-    bmpResource->width = readUint16(f);
-    bmpResource->height = readUint16(f);
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"INF:",4))
-        fatalError("'INF:' string not found while parsing BMP resource");
+static void decodeWorker(void *arg)
+{
+    // The workers are all alike, they are given no argument
+    (void) arg;
+    decodeQueuedJobs();
+}
 
-    free(buffer);
 
-    bmpResource->dataSize = readUint32(f);
-    bmpResource->numImages = readUint16(f);
+static void stopDecodeWorkers(void)
+{
+    // Called on exit, before the cache is saved: the jobs being run
+    // are completed, those still queued are left alone
+    platformLockMutex(decodeMutex);
+    decodeQuit = 1;
+    platformUnlockMutex(decodeMutex);
 
-    bmpResource->widths = readUint16Block(f, bmpResource->numImages);
-    bmpResource->heights = readUint16Block(f, bmpResource->numImages);
+    for (int i=0; i < numDecodeWorkers; i++)
+        platformJoinThread(decodeWorkers[i]);
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"BIN:",4))
-        fatalError("'BIN:' string not found while parsing BMP resource");
+    numDecodeWorkers = 0;
+}
 
-    free(buffer);
 
-    bmpResource->compressedSize = readUint32(f) - 5; // discard size of compressionmethod+uncompressedsize
-    bmpResource->compressionMethod = readUint8(f);
-    bmpResource->uncompressedSize = readUint32(f);
+void saveResourcesCache(void)
+{
+    // The workers stop once the queue is empty: waiting for them
+    // gets every script into the cache
+    for (int i=0; i < numDecodeWorkers; i++)
+        platformJoinThread(decodeWorkers[i]);
 
-    bmpResource->uncompressedData = uncompress(f,
-                                      bmpResource->compressionMethod,
-                                      bmpResource->compressedSize,
-                                      bmpResource->uncompressedSize
-                                    );
+    numDecodeWorkers = 0;
 
-    return bmpResource;
+    cacheSave();
 }
 
 
-static struct TPalResource *parsePalResource(FILE *f)
+static void startDecodeWorkers()
 {
-    struct TPalResource *palResource;
-    uint8 *buffer;
+    int numWorkers;
 
+    if (resPreloadDisabled)
+        return;
 
-    palResource = safe_malloc(sizeof(struct TPalResource));
+    decodeQueue = safe_malloc_array(numDecodeJobs, sizeof(int));
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"PAL:",4))
-        fatalError("'PAL:' string not found while parsing PAL resource");
+    // Only the scripts are left to preload, in the order of the map.
+    // INTRO.SCR and the palette used to be queued first, so that the
+    // intro could start at once: BMP and SCR payloads are now decoded
+    // when their pixels are needed, and the palette has no compressed
+    // payload - it is ready as soon as it is parsed.
+    for (int i=0; i < numDecodeJobs; i++)
+        if (!decodeJobs[i].isPixels)
+            decodeQueue[numQueuedJobs++] = i;
 
-    free(buffer);
+    // Leave one core to the main thread - but even on a single core,
+    // a worker has plenty of idle time to use between frames
+    numWorkers = platformGetCPUCount() - 1;
 
-    palResource->size = readUint16(f);
-    palResource->unknown1 = readUint8(f);
-    palResource->unknown2 = readUint8(f);
+    if (numWorkers < 1)
+        numWorkers = 1;
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"VGA:",4))
-        fatalError("'VGA:' string not found while parsing PAL resource");
+    if (numWorkers > MAX_DECODE_WORKERS)
+        numWorkers = MAX_DECODE_WORKERS;
 
-    free(buffer);
+    for (int i=0; i < numWorkers; i++) {
 
-    readUint8(f);   // size ?
-    readUint8(f);
-    readUint8(f);
-    readUint8(f);
+        decodeWorkers[numDecodeWorkers] = platformCreateThread(decodeWorker, NULL);
 
-    for (int i=0; i < 256; i++) {
-        palResource->colors[i].r = readUint8(f);
-        palResource->colors[i].g = readUint8(f);
-        palResource->colors[i].b = readUint8(f);
+        if (decodeWorkers[numDecodeWorkers] == NULL)
+            break;
+
+        numDecodeWorkers++;
     }
 
-    return palResource;
+    // Without threads, the scripts are decoded right away, as
+    // they would be by the workers
+    if (numDecodeWorkers == 0) {
+        debugMsg("No resources decoding workers, decoding synchronously");
+        decodeQueuedJobs();
+        return;
+    }
+
+    // Registered after cacheOpen(), so run before cacheSave() on exit
+    atexit(stopDecodeWorkers);
+
+    debugMsg("Started %d resources decoding workers", numDecodeWorkers);
 }
 
 
-static struct TScrResource *parseScrResource(FILE *f)
+static struct TAdsResource *parseAdsResource(uint8 *data, uint32 dataSize)
 {
-    struct TScrResource *scrResource;
-    uint8 *buffer;
+    struct TAdsResource *adsResource;
+    uint32 offset = 0;
 
 
-    scrResource = safe_malloc(sizeof(struct TScrResource));
+    adsResource = safe_malloc(sizeof(struct TAdsResource));
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"SCR:",4))
-        fatalError("'SCR:' string not found while parsing SCR resource");
+    parseMagic(data, &offset, dataSize, "VER:", "ADS");
+    checkSize(offset, 9, dataSize, "ADS");
 
-    free(buffer);
+    adsResource->versionSize = peekUint32(data, &offset);
+    adsResource->versionString = data + offset;
+    offset += 5;
 
-    scrResource->totalSize = readUint16(f);
-    scrResource->flags = readUint16(f);
+    parseMagic(data, &offset, dataSize, "ADS:", "ADS");
+    checkSize(offset, 4, dataSize, "ADS");
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"DIM:",4))
-        fatalError("'DIM:' string not found while parsing SCR resource");
+    adsResource->adsUnknown1 = peekUint8(data, &offset);
+    adsResource->adsUnknown2 = peekUint8(data, &offset);
+    adsResource->adsUnknown3 = peekUint8(data, &offset);
+    adsResource->adsUnknown4 = peekUint8(data, &offset);
 
-    free(buffer);
+    parseMagic(data, &offset, dataSize, "RES:", "ADS");
+    checkSize(offset, 6, dataSize, "ADS");
 
-    scrResource->dimSize = readUint32(f);
-    scrResource->width = readUint16(f);
-    scrResource->height = readUint16(f);
+    adsResource->resSize = peekUint32(data, &offset);
+    adsResource->numRes = peekUint16(data, &offset);
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"BIN:",4))
-        fatalError("'BIN:' string not found while parsing SCR resource");
+    adsResource->res = safe_malloc(adsResource->numRes * sizeof(struct TAdsRes));
 
-    free(buffer);
+    for (int i=0; i < adsResource->numRes; i++) {
+        checkSize(offset, 2, dataSize, "ADS");
+        adsResource->res[i].id = peekUint16(data, &offset);
+        adsResource->res[i].name = parseString(data, &offset, dataSize, 40);
+    }
 
-    scrResource->compressedSize = readUint32(f) - 5; // discard size of compressionmethod+uncompressedsize
-    scrResource->compressionMethod = readUint8(f);
-    scrResource->uncompressedSize = readUint32(f) ;
+    parseMagic(data, &offset, dataSize, "SCR:", "ADS");
 
-    scrResource->uncompressedData = uncompress(f,
-                                      scrResource->compressionMethod,
-                                      scrResource->compressedSize,
-                                      scrResource->uncompressedSize
-                                    );
+    adsResource->uncompressedData = NULL;
+    adsResource->compressedData = parseCompressedData(data, &offset, dataSize,
+                                    &adsResource->compressedSize,
+                                    &adsResource->compressionMethod,
+                                    &adsResource->uncompressedSize
+                                  );
 
-    return scrResource;
+    parseMagic(data, &offset, dataSize, "TAG:", "ADS");
+    checkSize(offset, 6, dataSize, "ADS");
+
+    adsResource->tagSize = peekUint32(data, &offset);
+    adsResource->numTags = peekUint16(data, &offset);
+
+    adsResource->tags = safe_malloc(adsResource->numTags * sizeof(struct TTags));
+
+    for (int i=0; i < adsResource->numTags; i++) {
+        checkSize(offset, 2, dataSize, "ADS");
+        adsResource->tags[i].id = peekUint16(data, &offset);
+        adsResource->tags[i].description = parseString(data, &offset, dataSize, 40);
+    }
+
+    return adsResource;
 }
 
 
-static struct TTtmResource *parseTtmResource(FILE *f)
+static struct TBmpResource *parseBmpResource(uint8 *data, uint32 dataSize)
 {
-    struct TTtmResource *ttmResource;
-    uint8 *buffer;
+    struct TBmpResource *bmpResource;
+    uint32 offset = 0;
+
+
+    bmpResource = safe_malloc(sizeof(struct TBmpResource));
+
+    parseMagic(data, &offset, dataSize, "BMP:", "BMP");
+    checkSize(offset, 4, dataSize, "BMP");
+
+    bmpResource->width = peekUint16(data, &offset);
+    bmpResource->height = peekUint16(data, &offset);
+
+    parseMagic(data, &offset, dataSize, "INF:", "BMP");
+    checkSize(offset, 6, dataSize, "BMP");
+
+    bmpResource->dataSize = peekUint32(data, &offset);
+    bmpResource->numImages = peekUint16(data, &offset);
+
+    bmpResource->widths = safe_malloc(bmpResource->numImages * sizeof(uint16));
+    bmpResource->heights = safe_malloc(bmpResource->numImages * sizeof(uint16));
+    checkSize(offset, bmpResource->numImages * 4, dataSize, "BMP");
+    peekUint16Block(data, &offset, bmpResource->widths, bmpResource->numImages);
+    peekUint16Block(data, &offset, bmpResource->heights, bmpResource->numImages);
+
+    parseMagic(data, &offset, dataSize, "BIN:", "BMP");
+
+    bmpResource->uncompressedData = NULL;
+    bmpResource->compressedData = parseCompressedData(data, &offset, dataSize,
+                                    &bmpResource->compressedSize,
+                                    &bmpResource->compressionMethod,
+                                    &bmpResource->uncompressedSize
+                                  );
+
+    return bmpResource;
+}
+
+
+static struct TPalResource *parsePalResource(uint8 *data, uint32 dataSize)
+{
+    struct TPalResource *palResource;
+    uint32 offset = 0;
 
-    ttmResource = safe_malloc(sizeof(struct TTtmResource));
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"VER:",4))
-        fatalError("'VER:' string not found while parsing TTM resource");
+    palResource = safe_malloc(sizeof(struct TPalResource));
+
+    parseMagic(data, &offset, dataSize, "PAL:", "PAL");
+    checkSize(offset, 4, dataSize, "PAL");
+
+    palResource->size = peekUint16(data, &offset);
+    palResource->unknown1 = peekUint8(data, &offset);
+    palResource->unknown2 = peekUint8(data, &offset);
+
+    parseMagic(data, &offset, dataSize, "VGA:", "PAL");
+
+    checkSize(offset, 4 + 256 * 3, dataSize, "PAL");
+
+    offset += 4;   // size ?
+
+    for (int i=0; i < 256; i++) {
+        palResource->colors[i].r = peekUint8(data, &offset);
+        palResource->colors[i].g = peekUint8(data, &offset);
+        palResource->colors[i].b = peekUint8(data, &offset);
+    }
+
+    return palResource;
+}
+
+
+static struct TScrResource *parseScrResource(uint8 *data, uint32 dataSize)
+{
+    struct TScrResource *scrResource;
+    uint32 offset = 0;
 
-    free(buffer);
 
-    ttmResource->versionSize = readUint32(f);
-    ttmResource->versionString = readUint8Block(f,5);
+    scrResource = safe_malloc(sizeof(struct TScrResource));
+
+    parseMagic(data, &offset, dataSize, "SCR:", "SCR");
+    checkSize(offset, 4, dataSize, "SCR");
+
+    scrResource->totalSize = peekUint16(data, &offset);
+    scrResource->flags = peekUint16(data, &offset);
+
+    parseMagic(data, &offset, dataSize, "DIM:", "SCR");
+    checkSize(offset, 8, dataSize, "SCR");
+
+    scrResource->dimSize = peekUint32(data, &offset);
+    scrResource->width = peekUint16(data, &offset);
+    scrResource->height = peekUint16(data, &offset);
+
+    parseMagic(data, &offset, dataSize, "BIN:", "SCR");
+
+    scrResource->uncompressedData = NULL;
+    scrResource->compressedData = parseCompressedData(data, &offset, dataSize,
+                                    &scrResource->compressedSize,
+                                    &scrResource->compressionMethod,
+                                    &scrResource->uncompressedSize
+                                  );
+
+    return scrResource;
+}
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"PAG:",4))
-        fatalError("'PAG:' string not found while parsing TTM resource");
 
-    free(buffer);
+static struct TTtmResource *parseTtmResource(uint8 *data, uint32 dataSize)
+{
+    struct TTtmResource *ttmResource;
+    uint32 offset = 0;
 
-    ttmResource->numPages = readUint32(f);
-    ttmResource->pagUnknown1 = readUint8(f);
-    ttmResource->pagUnknown2 = readUint8(f);
+    ttmResource = safe_malloc(sizeof(struct TTtmResource));
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"TT3:",4))
-        fatalError("'TT3:' string not found while parsing TTM resource");
+    parseMagic(data, &offset, dataSize, "VER:", "TTM");
+    checkSize(offset, 9, dataSize, "TTM");
 
-    free(buffer);
+    ttmResource->versionSize = peekUint32(data, &offset);
+    ttmResource->versionString = data + offset;
+    offset += 5;
 
-    ttmResource->compressedSize = readUint32(f) - 5; // discard size of compressionmethod+uncompressedsize
-    ttmResource->compressionMethod = readUint8(f);
-    ttmResource->uncompressedSize = readUint32(f);
+    parseMagic(data, &offset, dataSize, "PAG:", "TTM");
+    checkSize(offset, 6, dataSize, "TTM");
 
-    ttmResource->uncompressedData = uncompress(f,
-                                      ttmResource->compressionMethod,
-                                      ttmResource->compressedSize,
-                                      ttmResource->uncompressedSize
-                                    );
+    ttmResource->numPages = peekUint32(data, &offset);
+    ttmResource->pagUnknown1 = peekUint8(data, &offset);
+    ttmResource->pagUnknown2 = peekUint8(data, &offset);
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"TTI:",4))
-        fatalError("'TTI:' string not found while parsing TTM resource");
+    parseMagic(data, &offset, dataSize, "TT3:", "TTM");
 
-    free(buffer);
+    ttmResource->uncompressedData = NULL;
+    ttmResource->compressedData = parseCompressedData(data, &offset, dataSize,
+                                    &ttmResource->compressedSize,
+                                    &ttmResource->compressionMethod,
+                                    &ttmResource->uncompressedSize
+                                  );
 
-    ttmResource->ttiUnknown1 = readUint8(f);
-    ttmResource->ttiUnknown2 = readUint8(f);
-    ttmResource->ttiUnknown3 = readUint8(f);
-    ttmResource->ttiUnknown4 = readUint8(f);
+    parseMagic(data, &offset, dataSize, "TTI:", "TTM");
+    checkSize(offset, 4, dataSize, "TTM");
 
-    buffer = readUint8Block(f,4);
-    if (memcmp(buffer,"TAG:",4))
-        fatalError("'TAG:' string not found while parsing TTM resource");
+    ttmResource->ttiUnknown1 = peekUint8(data, &offset);
+    ttmResource->ttiUnknown2 = peekUint8(data, &offset);
+    ttmResource->ttiUnknown3 = peekUint8(data, &offset);
+    ttmResource->ttiUnknown4 = peekUint8(data, &offset);
 
-    free(buffer);
+    parseMagic(data, &offset, dataSize, "TAG:", "TTM");
+    checkSize(offset, 6, dataSize, "TTM");
 
-    ttmResource->tagSize = readUint32(f);
-    ttmResource->numTags = readUint16(f);
+    ttmResource->tagSize = peekUint32(data, &offset);
+    ttmResource->numTags = peekUint16(data, &offset);
 
     ttmResource->tags = safe_malloc(ttmResource->numTags * sizeof(struct TTags));
 
     for (int i=0; i < ttmResource->numTags; i++) {
-        ttmResource->tags[i].id = readUint16(f);
-        ttmResource->tags[i].description = getString(f,40);
+        checkSize(offset, 2, dataSize, "TTM");
+        ttmResource->tags[i].id = peekUint16(data, &offset);
+        ttmResource->tags[i].description = parseString(data, &offset, dataSize, 40);
     }
 
     return ttmResource;
@@ -341,61 +597,259 @@ static struct TTtmResource *parseTtmResource(FILE *f)
 
 static void parseMapFile(char *fileName)
 {
-    FILE *f_map; // , *f_res;  // TODO
+    uint32 offset = 0;
 
-    f_map = fopen(fileName,"rb");
+    // Both files are mapped once and for all: resources names, tags
+    // descriptions, etc. are views into the mappings, not heap copies
+    mapFileData = mapFileReadOnly(fileName, &mapFileSize);
 
-    if (f_map == NULL)
+    if (mapFileData == NULL)
         fatalError("Resources map file not found: %s\n", fileName);
 
-    mapFile.unknown1 = readUint8(f_map);   // first 5 uint8s unknown
-    mapFile.unknown2 = readUint8(f_map);
-    mapFile.unknown3 = readUint8(f_map);
-    mapFile.unknown4 = readUint8(f_map);   // ? number of resources files available in this index
-    mapFile.unknown5 = readUint8(f_map);
-    mapFile.unknown6 = readUint8(f_map);
+    if (mapFileSize < 6)
+        fatalError("Resources map file is truncated: %s\n", fileName);
+
+    mapFile.unknown1 = peekUint8(mapFileData, &offset);   // first 5 uint8s unknown
+    mapFile.unknown2 = peekUint8(mapFileData, &offset);
+    mapFile.unknown3 = peekUint8(mapFileData, &offset);
+    mapFile.unknown4 = peekUint8(mapFileData, &offset);   // ? number of resources files available in this index
+    mapFile.unknown5 = peekUint8(mapFileData, &offset);
+    mapFile.unknown6 = peekUint8(mapFileData, &offset);
+
+    mapFile.resFileName = parseString(mapFileData, &offset, mapFileSize, 13);
+
+    if (mapFileSize - offset < 2)
+        fatalError("Resources map file is truncated: %s\n", fileName);
 
-    mapFile.resFileName = (char *) getString(f_map,13);
+    mapFile.numEntries = peekUint16(mapFileData, &offset);
 
-    mapFile.numEntries = readUint16(f_map);
+    if (offset + mapFile.numEntries * 8 > mapFileSize)
+        fatalError("Resources map file is truncated: %s\n", fileName);
 
     mapFile.Entries = safe_malloc(mapFile.numEntries * sizeof(struct TMapFileEntry));
 
     for (int i=0; i<mapFile.numEntries; i++) {
-        mapFile.Entries[i].length = readUint32(f_map);
-        mapFile.Entries[i].offset = readUint32(f_map);
+        mapFile.Entries[i].length = peekUint32(mapFileData, &offset);
+        mapFile.Entries[i].offset = peekUint32(mapFileData, &offset);
     }
+}
+
 
-    fclose(f_map);
+static uint32 hashResName(uint32 seed, char *name)
+{
+    // FNV-1a, seeded
+    uint32 hash = 2166136261u ^ seed;
+
+    while (*name) {
+        hash ^= (uint8) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
 }
 
 
-static void parseResourceFile(char * filename)
+static int compareBucketSizes(const void *a, const void *b)
+{
+    const uint32 *bucketA = a, *bucketB = b;
+
+    return (int) bucketB[1] - (int) bucketA[1];
+}
+
+
+static void buildResourcesIndex()
+{
+    uint32 numKeys = mapFile.numEntries;
+    uint32 *buckets;      // pairs of (bucket number, number of keys)
+    uint32 *keyBuckets;
+    uint16 *bucketKeys;
+    uint8  *slotUsed;
+    uint32 *trySlots;
+
+    resIndexSize = (numKeys ? numKeys : 1);
+
+    resIndexDisplacements = safe_malloc(resIndexSize * sizeof(int));
+    resIndexSlots         = safe_malloc(resIndexSize * sizeof(uint16));
+    slotUsed              = safe_malloc(resIndexSize);
+    buckets               = safe_malloc(resIndexSize * 2 * sizeof(uint32));
+    keyBuckets            = safe_malloc_array(numKeys, sizeof(uint32));
+    bucketKeys            = safe_malloc_array(numKeys, sizeof(uint16));
+    trySlots              = safe_malloc_array(numKeys, sizeof(uint32));
+
+    memset(resIndexDisplacements, 0, resIndexSize * sizeof(int));
+    memset(slotUsed, 0, resIndexSize);
+
+    for (uint32 i=0; i < resIndexSize; i++) {
+        resIndexSlots[i] = 0;
+        buckets[2*i] = i;
+        buckets[2*i+1] = 0;
+    }
+
+    for (uint32 i=0; i < numKeys; i++) {
+        keyBuckets[i] = hashResName(0, mapFile.Entries[i].resName) % resIndexSize;
+        buckets[2 * keyBuckets[i] + 1]++;
+    }
+
+    // Place the most crowded buckets first, while the table is still empty
+    qsort(buckets, resIndexSize, 2 * sizeof(uint32), compareBucketSizes);
+
+    for (uint32 b=0; b < resIndexSize && buckets[2*b+1]; b++) {
+
+        uint32 bucketNo = buckets[2*b];
+        uint32 numBucketKeys = 0;
+
+        // Gather the keys of this bucket - a name appearing twice in the
+        // map would never be separated, so only its first entry is kept
+        for (uint32 i=0; i < numKeys; i++) {
+
+            char *resName = mapFile.Entries[i].resName;
+
+            if (keyBuckets[i] == bucketNo) {
+
+                int isDuplicate = 0;
+
+                for (uint32 j=0; j < numBucketKeys && !isDuplicate; j++)
+                    if (!strcmp(mapFile.Entries[bucketKeys[j]].resName, resName))
+                        isDuplicate = 1;
+
+                if (!isDuplicate)
+                    bucketKeys[numBucketKeys++] = i;
+            }
+        }
+
+        // Single-key buckets are stored directly in any free slot
+        if (numBucketKeys == 1) {
+
+            uint32 slot = 0;
+
+            while (slotUsed[slot])
+                slot++;
+
+            slotUsed[slot] = 1;
+            resIndexSlots[slot] = bucketKeys[0];
+            resIndexDisplacements[bucketNo] = -(int) slot - 1;
+            continue;
+        }
+
+        // Otherwise look for a seed which sends all the keys of the
+        // bucket to distinct free slots
+        for (int seed=1; ; seed++) {
+
+            uint32 k;
+
+            if (seed > 1000000)
+                fatalError("Could not build the resources index");
+
+            for (k=0; k < numBucketKeys; k++) {
+
+                uint32 slot = hashResName(seed, mapFile.Entries[bucketKeys[k]].resName) % resIndexSize;
+
+                if (slotUsed[slot])
+                    break;
+
+                slotUsed[slot] = 1;
+                trySlots[k] = slot;
+            }
+
+            if (k == numBucketKeys) {
+                for (k=0; k < numBucketKeys; k++)
+                    resIndexSlots[trySlots[k]] = bucketKeys[k];
+                resIndexDisplacements[bucketNo] = seed;
+                break;
+            }
+
+            while (k--)
+                slotUsed[trySlots[k]] = 0;
+        }
+    }
+
+    free(trySlots);
+    free(bucketKeys);
+    free(keyBuckets);
+    free(buckets);
+    free(slotUsed);
+}
+
+
+static void parseResourceFile(void)
 {
-    FILE *f;
     char filepath[256];
 
-    sprintf(filepath, "data/%s", mapFile.resFileName);
+    snprintf(filepath, sizeof(filepath), "data/%s", mapFile.resFileName);
 
-    f = fopen(filepath,"rb");
+    resFileData = mapFileReadOnly(filepath, &resFileSize);
 
-    if (f == NULL)
+    if (resFileData == NULL)
         fatalError("Main resources file not found: %s\n", mapFile.resFileName);
 
+    cacheOpen(CACHE_FILENAME, resFileData, resFileSize);
+
+    // First pass: read the entries headers, so that the resources
+    // tables can be sized from the actual content of the map
+    for (int i=0; i < mapFile.numEntries; i++) {
+
+        uint32 offset = mapFile.Entries[i].offset;
+
+        if (offset > resFileSize || resFileSize - offset < 17)
+            fatalError("Resource #%d is out of the resources file", i);
+
+        mapFile.Entries[i].resName = (char *) resFileData + offset;
+        offset += 13;
+        mapFile.Entries[i].resSize = peekUint32(resFileData, &offset);
+        mapFile.Entries[i].resource = NULL;
+
+        if (memchr(mapFile.Entries[i].resName, 0, 13) == NULL)
+            fatalError("Resource #%d has an invalid name", i);
+
+        char *resName = mapFile.Entries[i].resName;
+        char *resType = resName + strlen(resName) - 4;  // get the extension .BMP .ADS etc.
+
+        if (!strcmp(resType, ".ADS"))
+            numAdsResources++;
+        else if (!strcmp(resType, ".BMP"))
+            numBmpResources++;
+        else if (!strcmp(resType, ".PAL"))
+            numPalResources++;
+        else if (!strcmp(resType, ".SCR"))
+            numScrResources++;
+        else if (!strcmp(resType, ".TTM"))
+            numTtmResources++;
+    }
+
+    adsResources = safe_malloc_array(numAdsResources, sizeof(struct TAdsResource *));
+    bmpResources = safe_malloc_array(numBmpResources, sizeof(struct TBmpResource *));
+    palResources = safe_malloc_array(numPalResources, sizeof(struct TPalResource *));
+    scrResources = safe_malloc_array(numScrResources, sizeof(struct TScrResource *));
+    ttmResources = safe_malloc_array(numTtmResources, sizeof(struct TTtmResource *));
+
+    numAdsResources = 0;
+    numBmpResources = 0;
+    numPalResources = 0;
+    numScrResources = 0;
+    numTtmResources = 0;
+
+    selectExpandKernel();
+
+    decodeJobs  = safe_malloc_array(mapFile.numEntries, sizeof(struct TDecodeJob));
+    decodeMutex = platformCreateMutex();
+    decodeCond  = platformCreateCond();
+
+    if (decodeMutex == NULL || decodeCond == NULL)
+        fatalError("Could not create the resources decoding lock");
+
     if (debugMode) {
         printf("Loading resources ");
         fflush (stdout);
     }
 
+    // Second pass: parse the resources themselves
     for (int i=0; i < mapFile.numEntries; i++) {
 
-        fseek(f, mapFile.Entries[i].offset, SEEK_SET);
-
-        mapFile.Entries[i].resName = (char *) readUint8Block(f,13);
-        mapFile.Entries[i].resSize = readUint32(f);
-
         char *resName = mapFile.Entries[i].resName;
-        char *resType = resName + strlen(resName) - 4;  // get the extension .BMP .ADS etc.
+        char *resType = resName + strlen(resName) - 4;
+        uint32 offset = mapFile.Entries[i].offset + 17;
+        uint8 *resData = resFileData + offset;
+        uint32 resSize = resFileSize - offset;   // parsing must not go past the mapping
 
         if (debugMode) {
              putchar('.');
@@ -403,73 +857,137 @@ static void parseResourceFile(char * filename)
         }
 
         if (!strcmp(resType, ".ADS")) {
-            adsResources[numAdsResources] = parseAdsResource(f);
+            adsResources[numAdsResources] = parseAdsResource(resData, resSize);
             adsResources[numAdsResources]->resName = resName;
-            numAdsResources++;
+            adsResources[numAdsResources]->decodeJob = newDecodeJob(resName,
+                adsResources[numAdsResources]->compressedData,
+                adsResources[numAdsResources]->compressionMethod,
+                adsResources[numAdsResources]->compressedSize,
+                adsResources[numAdsResources]->uncompressedSize,
+                &adsResources[numAdsResources]->uncompressedData
+            );
+            mapFile.Entries[i].resource = adsResources[numAdsResources++];
         }
         else if (!strcmp(resType, ".BMP")) {
-            bmpResources[numBmpResources] = parseBmpResource(f);
+            bmpResources[numBmpResources] = parseBmpResource(resData, resSize);
             bmpResources[numBmpResources]->resName = resName;
-            numBmpResources++;
+            bmpResources[numBmpResources]->decodeJob = newDecodeJob(resName,
+                bmpResources[numBmpResources]->compressedData,
+                bmpResources[numBmpResources]->compressionMethod,
+                bmpResources[numBmpResources]->compressedSize,
+                bmpResources[numBmpResources]->uncompressedSize,
+                &bmpResources[numBmpResources]->uncompressedData
+            );
+            decodeJobs[bmpResources[numBmpResources]->decodeJob].isPixels = 1;
+            mapFile.Entries[i].resource = bmpResources[numBmpResources++];
         }
         else if (!strcmp(resType, ".PAL")) {
-            palResources[numPalResources] = parsePalResource(f);
+            palResources[numPalResources] = parsePalResource(resData, resSize);
             palResources[numPalResources]->resName = resName;
-            numPalResources++;
+            mapFile.Entries[i].resource = palResources[numPalResources++];
         }
         else if (!strcmp(resType, ".SCR")) {
-            scrResources[numScrResources] = parseScrResource(f);
+            scrResources[numScrResources] = parseScrResource(resData, resSize);
             scrResources[numScrResources]->resName = resName;
-            numScrResources++;
+            scrResources[numScrResources]->decodeJob = newDecodeJob(resName,
+                scrResources[numScrResources]->compressedData,
+                scrResources[numScrResources]->compressionMethod,
+                scrResources[numScrResources]->compressedSize,
+                scrResources[numScrResources]->uncompressedSize,
+                &scrResources[numScrResources]->uncompressedData
+            );
+            decodeJobs[scrResources[numScrResources]->decodeJob].isPixels = 1;
+            mapFile.Entries[i].resource = scrResources[numScrResources++];
         }
         else if (!strcmp(resType, ".TTM")) {
-            ttmResources[numTtmResources] = parseTtmResource(f);
+            ttmResources[numTtmResources] = parseTtmResource(resData, resSize);
             ttmResources[numTtmResources]->resName = resName;
-            numTtmResources++;
+            ttmResources[numTtmResources]->decodeJob = newDecodeJob(resName,
+                ttmResources[numTtmResources]->compressedData,
+                ttmResources[numTtmResources]->compressionMethod,
+                ttmResources[numTtmResources]->compressedSize,
+                ttmResources[numTtmResources]->uncompressedSize,
+                &ttmResources[numTtmResources]->uncompressedData
+            );
+            mapFile.Entries[i].resource = ttmResources[numTtmResources++];
         }
         // Note: there is one .VIN type file too (FILES.VIN)
         // We dont process it since it's nothing else than a list
         // of files, which we dont need
     }
 
-    fclose(f);
-
     if (debugMode)
         putchar('\n');
+
+    if (numPalResources == 0)
+        fatalError("No palette found in %s", mapFile.resFileName);
 }
 
 
 void parseResourceFiles(char * filename)
 {
     parseMapFile(filename);
-    parseResourceFile(filename);
+    parseResourceFile();
+    buildResourcesIndex();
+    startDecodeWorkers();
 }
 
 
-struct TAdsResource *findAdsResource(char *searchString)
+static void *findResource(char *searchString, char *resType)
 {
-    struct TAdsResource *result = NULL;
+    uint32 bucketNo = hashResName(0, searchString) % resIndexSize;
+    int displacement = resIndexDisplacements[bucketNo];
+    uint32 slot;
+    struct TMapFileEntry *entry;
 
-    for (int i=0; i < numAdsResources && result == NULL; i++) {
-        if (!strcmp(adsResources[i]->resName, searchString))
-            result = adsResources[i];
-    }
+    if (displacement < 0)
+        slot = -displacement - 1;
+    else
+        slot = hashResName(displacement, searchString) % resIndexSize;
+
+    // The index only knows about the names it was built with:
+    // any other name lands on some slot, hence the final check
+    entry = &mapFile.Entries[resIndexSlots[slot]];
+
+    if (mapFile.numEntries == 0 || strcmp(entry->resName, searchString))
+        return NULL;
+
+    if (strcmp(entry->resName + strlen(entry->resName) - 4, resType))
+        return NULL;
+
+    return entry->resource;
+}
+
+
+struct TAdsResource *findAdsResource(char *searchString)
+{
+    struct TAdsResource *result = findResource(searchString, ".ADS");
 
     if (result == NULL)
         fatalError("ADS resource %s not found.", searchString);
 
+    materializeData(result->decodeJob);
+
     return result;
 }
 
 
 struct TBmpResource *findBmpResource(char *searchString)
 {
-    struct TBmpResource *result = NULL;
+    struct TBmpResource *result = findResource(searchString, ".BMP");
+
+    if (result == NULL)
+        fatalError("BMP resource %s not found.", searchString);
+
+    materializeData(result->decodeJob);
+
+    return result;
+}
 
-    for (int i=0; i < numBmpResources && result == NULL; i++) {
-        if (!strcmp(bmpResources[i]->resName, searchString))
-            result = bmpResources[i];
-    }
+
+struct TBmpResource *findBmpResourceHeader(char *searchString)
+{
+    struct TBmpResource *result = findResource(searchString, ".BMP");
 
     if (result == NULL)
         fatalError("BMP resource %s not found.", searchString);
@@ -478,14 +996,40 @@ struct TBmpResource *findBmpResource(char *searchString)
 }
 
 
+void expandBmpResource(struct TBmpResource *bmpResource, uint8 colorMap[16],
+                       uint8 *outPixels, uint32 numPixels)
+{
+    expandPayload(bmpResource->decodeJob, colorMap, outPixels, numPixels);
+}
+
+
+struct TPalResource *findPalResource(char *searchString)
+{
+    struct TPalResource *result = findResource(searchString, ".PAL");
+
+    if (result == NULL)
+        fatalError("PAL resource %s not found.", searchString);
+
+    return result;
+}
+
+
 struct TScrResource *findScrResource(char *searchString)
 {
-    struct TScrResource *result = NULL;
+    struct TScrResource *result = findResource(searchString, ".SCR");
 
-    for (int i=0; i < numScrResources && result == NULL; i++) {
-        if (!strcmp(scrResources[i]->resName, searchString))
-            result = scrResources[i];
-    }
+    if (result == NULL)
+        fatalError("SCR resource %s not found.", searchString);
+
+    materializeData(result->decodeJob);
+
+    return result;
+}
+
+
+struct TScrResource *findScrResourceHeader(char *searchString)
+{
+    struct TScrResource *result = findResource(searchString, ".SCR");
 
     if (result == NULL)
         fatalError("SCR resource %s not found.", searchString);
@@ -494,18 +1038,21 @@ struct TScrResource *findScrResource(char *searchString)
 }
 
 
-struct TTtmResource *findTtmResource(char *searchString)
+void expandScrResource(struct TScrResource *scrResource, uint8 colorMap[16],
+                       uint8 *outPixels, uint32 numPixels)
 {
-    struct TTtmResource *result = NULL;
+    expandPayload(scrResource->decodeJob, colorMap, outPixels, numPixels);
+}
 
-    for (int i=0; i < numTtmResources && result == NULL; i++) {
-        if (!strcmp(ttmResources[i]->resName, searchString))
-            result = ttmResources[i];
-    }
+
+struct TTtmResource *findTtmResource(char *searchString)
+{
+    struct TTtmResource *result = findResource(searchString, ".TTM");
 
     if (result == NULL)
         fatalError("TTM resource %s not found.", searchString);
 
+    materializeData(result->decodeJob);
+
     return result;
 }
-
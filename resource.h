@@ -46,6 +46,7 @@ struct TMapFileEntry {
     uint32 offset;
     char *resName;
     uint32 resSize;
+    void *resource;
 };
 
 
@@ -63,7 +64,9 @@ struct TAdsResource {
     uint32 compressedSize;
     uint8 compressionMethod;
     uint32 uncompressedSize;
-    uint8 *uncompressedData;
+    uint8 *compressedData;      // view into the resources file
+    uint8 *uncompressedData;    // NULL until decoded
+    int decodeJob;
     uint32 tagSize;
     uint16 numTags;
     struct TTags *tags;
@@ -87,7 +90,9 @@ struct TBmpResource {
     uint32 compressedSize;
     uint8 compressionMethod;
     uint32 uncompressedSize;
-    uint8 *uncompressedData;
+    uint8 *compressedData;      // view into the resources file
+    uint8 *uncompressedData;    // NULL until decoded
+    int decodeJob;
 };
 
 
@@ -117,7 +122,9 @@ struct TScrResource {
     uint32 compressedSize;
     uint8 compressionMethod;
     uint32 uncompressedSize;
-    uint8 *uncompressedData;
+    uint8 *compressedData;      // view into the resources file
+    uint8 *uncompressedData;    // NULL until decoded
+    int decodeJob;
 };
 
 
@@ -131,7 +138,9 @@ struct TTtmResource {
     uint32 compressedSize;
     uint8 compressionMethod;
     uint32 uncompressedSize;
-    uint8 *uncompressedData;
+    uint8 *compressedData;      // view into the resources file
+    uint8 *uncompressedData;    // NULL until decoded
+    int decodeJob;
     uint8 ttiUnknown1;
     uint8 ttiUnknown2;
     uint8 ttiUnknown3;
@@ -152,16 +161,18 @@ struct TTags {
 //    Public variables
 //------------------------
 
-extern struct TAdsResource *adsResources[];
-extern struct TBmpResource *bmpResources[];
-extern struct TPalResource *palResources[];
-extern struct TScrResource *scrResources[];
-extern struct TTtmResource *ttmResources[];
+extern struct TAdsResource **adsResources;
+extern struct TBmpResource **bmpResources;
+extern struct TPalResource **palResources;
+extern struct TScrResource **scrResources;
+extern struct TTtmResource **ttmResources;
 extern int numAdsResources;
 extern int numBmpResources;
 extern int numPalResources;
 extern int numScrResources;
 extern int numTtmResources;
+extern int numMaterializedResources;
+extern int resPreloadDisabled;
 
 
 //----------------------------
@@ -169,9 +180,20 @@ extern int numTtmResources;
 //----------------------------
 
 void parseResourceFiles(char *);
+void saveResourcesCache(void);
 struct TAdsResource *findAdsResource(char *searchString);
 struct TBmpResource *findBmpResource(char *searchString);
+struct TPalResource *findPalResource(char *searchString);
 struct TScrResource *findScrResource(char *searchString);
 struct TTtmResource *findTtmResource(char *searchString);
 
+// Lookups which leave the payload alone, to be expanded straight to
+// 8bpp pixels, each 4bpp color number being translated through colorMap
+struct TBmpResource *findBmpResourceHeader(char *searchString);
+struct TScrResource *findScrResourceHeader(char *searchString);
+void expandBmpResource(struct TBmpResource *bmpResource, uint8 colorMap[16],
+                       uint8 *outPixels, uint32 numPixels);
+void expandScrResource(struct TScrResource *scrResource, uint8 colorMap[16],
+                       uint8 *outPixels, uint32 numPixels);
+
 #endif
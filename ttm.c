@@ -22,6 +22,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "mytypes.h"
 #include "utils.h"
@@ -29,6 +30,7 @@
 #include "graphics.h"
 #include "sound.h"
 #include "ttm.h"
+#include "cache.h"
 
 
 int ttmDx = 0;
@@ -80,6 +82,16 @@ void ttmLoadTtm(struct TTtmSlot *ttmSlot, char *ttmName)     // TODO
     ttmSlot->numTags  = ttmResource->numTags;
     ttmSlot->tags     = safe_malloc(ttmSlot->numTags * sizeof(struct TTtmTag));
 
+    uint32 tagsSize = ttmSlot->numTags * sizeof(struct TTtmTag);
+    struct TTtmTag *cachedTags = cacheFind(ttmResource->resName, CACHE_TAGS, tagsSize);
+
+    if (cachedTags != NULL) {
+        memcpy(ttmSlot->tags, cachedTags, tagsSize);
+        return;
+    }
+
+    memset(ttmSlot->tags, 0, tagsSize);
+
     // we have to bookmark every tag for later jumps
     uint32 offset=0;
     int tagNo = 0;
@@ -112,14 +124,16 @@ void ttmLoadTtm(struct TTtmSlot *ttmSlot, char *ttmName)     // TODO
     // TODO : in SASKDATE.TTM, num SET_SCENE != ttmResource->numTags
     while (tagNo < ttmSlot->numTags)
         ttmSlot->tags[tagNo++].id = 0;  // TODO is this useful ?
+
+    cacheAdd(ttmResource->resName, CACHE_TAGS, ttmSlot->tags, tagsSize);
 }
 
 
 void ttmInitSlot(struct TTtmSlot *ttmSlot)
 {
     for (int i=0; i < MAX_BMP_SLOTS; i++) {
-        ttmSlot->data          = NULL;
-        ttmSlot->numSprites[i] = 0;
+        ttmSlot->data            = NULL;
+        ttmSlot->spriteSheets[i] = NULL;
     }
 }
 
@@ -132,7 +146,7 @@ void ttmResetSlot(struct TTtmSlot *ttmSlot)
     }
 
     for (int i=0; i < MAX_BMP_SLOTS; i++) {
-        if (ttmSlot->numSprites[i])
+        if (ttmSlot->spriteSheets[i] != NULL)
             grReleaseBmp(ttmSlot, i);
     }
 }
@@ -23,145 +23,168 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "mytypes.h"
 #include "utils.h"
 
-static int nextbit;
-static uint8 current;
-static uint32 inOffset;
-static uint32 maxInOffset;
+#define LZW_MAX_CODES   4096
+#define LZW_CLEAR_CODE  256
 
-struct TCodeTableEntry {
-    uint16 prefix;
-    uint8 append;
+
+// The decoder keeps all its state in locals and only reads its
+// input buffer, so that several resources may be decoded at once
+struct TCodeTable {
+    uint16 prefix[LZW_MAX_CODES];
+    uint8  append[LZW_MAX_CODES];
+    uint16 length[LZW_MAX_CODES];   // length of the string a code stands for
 };
 
 
-static uint8 getByte(FILE *f)
+static inline uint32 peekBits(uint8 *inData, uint32 inSize, uint32 bitPos)
 {
-    if (inOffset >= maxInOffset) {
-        return 0;
+    // Returns at least 25 valid bits, bytes past the end reading as 0
+    uint32 bytePos = bitPos >> 3;
+    uint32 word;
+
+    if (bytePos + 4 <= inSize) {
+        word = (uint32) inData[bytePos]
+             | (uint32) inData[bytePos+1] << 8
+             | (uint32) inData[bytePos+2] << 16
+             | (uint32) inData[bytePos+3] << 24;
     }
     else {
-        inOffset++;
-        uint8 b = (uint8) fgetc(f);
-        return b;
+        word = 0;
+        for (int i=0; i < 4; i++)
+            if (bytePos + i < inSize)
+                word |= (uint32) inData[bytePos+i] << (8*i);
     }
+
+    return word >> (bitPos & 7);
 }
 
 
-static uint16 getBits(FILE *f, uint32 n)
+static inline void putByte(uint8 *outData, uint32 pos, uint8 byte, uint8 (*lut)[2])
 {
-    if (n == 0)
-        return 0;
-
-    uint32 x = 0;
-
-    for (uint32 i=0; i < n; i++) {
-        if (current & (1 << nextbit))
-            x |= (uint32) (1 << i);
+    // Either a plain byte, or the two 8bpp pixels its nibbles stand for
+    if (lut == NULL)
+        outData[pos] = byte;
+    else
+        memcpy(outData + (pos << 1), lut[byte], 2);
+}
 
-        nextbit++;
 
-        if (nextbit > 7) {
-            current = (uint8) getByte(f);
-            nextbit = 0;
-        }
+static uint8 writeString(struct TCodeTable *table, uint16 code, uint8 *outData,
+                         uint32 outOffset, uint32 outSize, uint8 (*lut)[2])
+{
+    // Strings are stored as (prefix code, last byte) chains, so they
+    // are written backwards from their end ; anything that would go
+    // past outSize is dropped. Returns the first byte of the string.
+    uint32 pos = outOffset + (code > 255 ? table->length[code] : 1);
+
+    while (code > 255 && pos > outOffset + 1) {
+        pos--;
+        if (pos < outSize)
+            putByte(outData, pos, table->append[code], lut);
+        code = table->prefix[code];
     }
 
-    return x;
+    if (outOffset < outSize)
+        putByte(outData, outOffset, (uint8) code, lut);
+
+    return (uint8) code;
 }
 
 
-uint8 *uncompressLZW(FILE *f, uint32 inSize, uint32 outSize)
+static void decodeLZW(uint8 *inData, uint32 inSize, uint8 *outData, uint32 outSize,
+                      uint8 (*lut)[2])
 {
-    uint8  *outData;
-    struct TCodeTableEntry codeTable[4096];
-    uint8  decodeStack[4096];
-    uint32 stackPtr = 0;
-    uint8  n_bits = 9;
+    struct TCodeTable *table;
+    uint32 n_bits = 9;
+    uint32 mask = (1 << 9) - 1;
     uint32 free_entry = 257;
     uint16 oldcode;
-    uint16 lastbyte;
-    uint32 bitpos = 0;
+    uint8  lastbyte;
+    uint32 bitpos = 0;       // bits read since the last code width change
+    uint32 inBitPos = 0;     // absolute read position
     uint32 outOffset = 0;
 
+    // The original decoder consumed its input one byte ahead
+    // of the bits it was decoding, and stopped once that
+    // look-ahead byte reached the end of the data
+    uint32 inBitEnd = (inSize ? (inSize - 1) << 3 : 0);
+
 
     if (outSize == 0)
         fatalError("uncompressLZW() : can't uncompress to 0 bytes\n");
 
-    maxInOffset = inSize;
-    nextbit     = 0;
-    inOffset    = 0;
-    outData     = safe_malloc(outSize * sizeof(uint8));
+    if (inSize > 0x1fffffff)
+        fatalError("uncompressLZW() : input too large\n");
 
-    current  = (uint8) getByte(f);
-    lastbyte = oldcode = getBits(f, n_bits);
+    table = safe_malloc(sizeof(struct TCodeTable));
 
-    outData[outOffset++] = (uint8) oldcode;
+    // Unused entries only get referenced by corrupt data:
+    // make them decode to one byte, like literals
+    for (int i=0; i < LZW_MAX_CODES; i++) {
+        table->prefix[i] = 0;
+        table->append[i] = 0;
+        table->length[i] = 1;
+    }
+
+    oldcode = peekBits(inData, inSize, inBitPos) & mask;
+    lastbyte = (uint8) oldcode;
+    inBitPos += n_bits;
 
-    while (inOffset < inSize) {
+    putByte(outData, outOffset++, (uint8) oldcode, lut);
 
-        uint16 newcode = getBits(f, n_bits);
+    while (inBitPos < inBitEnd) {
+
+        uint16 newcode = peekBits(inData, inSize, inBitPos) & mask;
+        inBitPos += n_bits;
         bitpos += n_bits;
 
-        if (newcode == 256) {
+        if (newcode == LZW_CLEAR_CODE) {
 
             uint32 nbits3 = n_bits << 3;
             uint32 nskip = (nbits3 - ((bitpos - 1) % nbits3)) - 1;
-            getBits(f, nskip);
+            inBitPos += nskip;
             n_bits = 9;
+            mask = (1 << 9) - 1;
             free_entry = 256;
             bitpos = 0;
         }
         else {
 
-            uint16 code = newcode;
-
-            if (code >= free_entry) {
+            if (newcode >= free_entry) {
+                // KwKwK case: the previous string plus the byte which
+                // was last decoded, which should be its first one
+                uint8 byte = lastbyte;
 
-                if (stackPtr > 4095)
-                    break;
+                lastbyte = writeString(table, oldcode, outData, outOffset, outSize, lut);
+                outOffset += (oldcode > 255 ? table->length[oldcode] : 1);
 
-                decodeStack[stackPtr] = (uint8) lastbyte;
-                stackPtr++;
-                code = oldcode;
+                if (outOffset < outSize)
+                    putByte(outData, outOffset, byte, lut);
+                outOffset++;
             }
-
-            while (code > 255) {
-
-                if (code > 4095)
-                    break;
-
-                decodeStack[stackPtr] = codeTable[code].append;  // TODO stackPtr >= 4096 ?
-                stackPtr++;
-                code = codeTable[code].prefix;
+            else {
+                lastbyte = writeString(table, newcode, outData, outOffset, outSize, lut);
+                outOffset += (newcode > 255 ? table->length[newcode] : 1);
             }
 
-            decodeStack[stackPtr] = (uint8) code;  // TODO stackPtr >= 4096 ?
-            stackPtr++;
-            lastbyte = code;
-
-            while (stackPtr > 0) {
+            if (outOffset >= outSize)
+                break;
 
-                stackPtr--;
+            if (free_entry < LZW_MAX_CODES) {
 
-                if (outOffset >= outSize)
-                    return outData;
-
-                outData[outOffset++] = decodeStack[stackPtr];
-            }
-
-            if (free_entry < 4096) {
-
-                codeTable[free_entry].prefix = (uint16)oldcode;
-                codeTable[free_entry].append = (uint8)lastbyte;
+                table->prefix[free_entry] = oldcode;
+                table->append[free_entry] = lastbyte;
+                table->length[free_entry] = (oldcode > 255 ? table->length[oldcode] : 1) + 1;
                 free_entry++;
-                uint32 temp = 1 << n_bits;
 
-                if (free_entry >= temp && n_bits < 12) {
+                if (free_entry >= (1u << n_bits) && n_bits < 12) {
                     n_bits++;
+                    mask = (1 << n_bits) - 1;
                     bitpos = 0;
                 }
             }
@@ -170,61 +193,94 @@ uint8 *uncompressLZW(FILE *f, uint32 inSize, uint32 outSize)
         }
     }
 
-    if (inOffset != inSize)
-        fatalError("error while uncompressing LZW");
-
-    return outData;
+    free(table);
 }
 
 
-uint8 *uncompressRLE(FILE *f, uint32 inSize, uint32 outSize)
+static uint32 decodeRLE(uint8 *inData, uint32 inSize, uint8 *outData, uint32 outSize,
+                        uint8 (*lut)[2])
 {
-    uint8 *outData;
+    uint32 inOffset = 0;
     uint32 outOffset = 0;
 
-    inOffset    = 0;
-    maxInOffset = inSize;
-
-    outData = safe_malloc(outSize * sizeof(uint8));
-
     while (outOffset < outSize) {
 
-        uint8 control = (uint8) fgetc(f);
-        inOffset++;
+        if (inOffset >= inSize)
+            fatalError("error while uncompressing RLE: input too short");
+
+        uint8 control = inData[inOffset++];
 
         if ((control & 0x80) == 0x80) {
-            uint8 length = control & 0x7F;
-            uint8 b = (uint8) fgetc(f);
-            inOffset++;
+            uint32 length = control & 0x7F;
+            uint8 b = (inOffset < inSize ? inData[inOffset++] : 0);
 
-            for (int i=0; i < length; i++)
-                outData[outOffset++] = b;    // TODO outOffset > outSize ?
+            if (length > outSize - outOffset)
+                length = outSize - outOffset;
+
+            if (lut == NULL) {
+                memset(outData + outOffset, b, length);
+                outOffset += length;
+            }
+            else {
+                for (uint32 i=0; i < length; i++)
+                    putByte(outData, outOffset++, b, lut);
+            }
         }
         else {
-            for (int i=0;  i < control; i++) {
-                outData[outOffset++] = (uint8) fgetc(f);  // TODO idem
-                inOffset++;
-            }
+            uint32 length = control;
+
+            if (length > outSize - outOffset)
+                length = outSize - outOffset;
+
+            // bytes past the end of the input read as 0
+            for (uint32 i=0; i < length; i++)
+                putByte(outData, outOffset++, (inOffset < inSize ? inData[inOffset++] : 0), lut);
         }
     }
 
-    if (inOffset != inSize)
-        fatalError("error while uncompressing RLE");
+    return inOffset;
+}
+
+
+static void buildExpandTable(uint8 colorMap[16], uint8 lut[256][2])
+{
+    for (int i=0; i < 256; i++) {
+        lut[i][0] = colorMap[i >> 4];
+        lut[i][1] = colorMap[i & 0xf];
+    }
+}
+
+
+uint8 *uncompressLZW(uint8 *inData, uint32 inSize, uint32 outSize)
+{
+    uint8 *outData = safe_malloc(outSize * sizeof(uint8));
+
+    decodeLZW(inData, inSize, outData, outSize, NULL);
 
     return outData;
 }
 
 
-uint8 *uncompress(FILE *f, uint8 compressionMethod, uint32 inSize, uint32 outSize)
+uint8 *uncompressRLE(uint8 *inData, uint32 inSize, uint32 outSize)
+{
+    uint8 *outData = safe_malloc(outSize * sizeof(uint8));
+
+    if (decodeRLE(inData, inSize, outData, outSize, NULL) != inSize)
+        fatalError("error while uncompressing RLE");
+
+    return outData;
+}
+
+uint8 *uncompress(uint8 *inData, uint8 compressionMethod, uint32 inSize, uint32 outSize)
 {
     switch (compressionMethod) {
 
         case 1:
-            return uncompressRLE(f, inSize, outSize);
+            return uncompressRLE(inData, inSize, outSize);
             break;
 
         case 2:
-            return uncompressLZW(f, inSize, outSize);
+            return uncompressLZW(inData, inSize, outSize);
             break;
 
         default:
@@ -233,3 +289,30 @@ uint8 *uncompress(FILE *f, uint8 compressionMethod, uint32 inSize, uint32 outSiz
     }
 }
 
+
+
+void uncompressExpand(uint8 *inData, uint8 compressionMethod, uint32 inSize,
+                      uint32 outSize, uint8 colorMap[16], uint8 *outPixels)
+{
+    // Decodes the first outSize bytes of 4bpp data straight
+    // to the 2 * outSize bytes of 8bpp pixels they stand for
+    uint8 lut[256][2];
+
+    buildExpandTable(colorMap, lut);
+
+    switch (compressionMethod) {
+
+        case 1:
+            decodeRLE(inData, inSize, outPixels, outSize, lut);
+            break;
+
+        case 2:
+            decodeLZW(inData, inSize, outPixels, outSize, lut);
+            break;
+
+        default:
+            fatalError("Unknown compression method %d", compressionMethod);
+            break;
+    }
+}
+
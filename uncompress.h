@@ -21,5 +21,7 @@
  *
  */
 
-uint8 *uncompress(FILE *f, uint8 compressionMethod, uint32 inSize, uint32 outSize);
+uint8 *uncompress(uint8 *inData, uint8 compressionMethod, uint32 inSize, uint32 outSize);
+void  uncompressExpand(uint8 *inData, uint8 compressionMethod, uint32 inSize,
+                       uint32 outSize, uint8 colorMap[16], uint8 *outPixels);
 
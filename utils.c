@@ -28,11 +28,21 @@
 #include <time.h>
 #ifdef _WIN32
 // Windows does not have sys/time.h; use time.h or implement needed functions
+#include <windows.h>
 #else
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #include "mytypes.h"
+#include "utils.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
 
 
 #define BUF_LEN 256
@@ -76,6 +86,28 @@ void *safe_malloc(size_t size)
 }
 
 
+void *safe_realloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+
+    if (ptr == NULL)
+        fatalError("failed to realloc() %d bytes", size);
+
+    return ptr;
+}
+
+
+void *safe_malloc_array(size_t count, size_t size)
+{
+    // The array may be empty, and malloc(0) may return NULL,
+    // which safe_malloc() would take for a failure
+    if (size != 0 && count > SIZE_MAX / size)
+        fatalError("failed to malloc() %d elements of %d bytes", count, size);
+
+    return safe_malloc(count != 0 && size != 0 ? count * size : 1);
+}
+
+
 FILE *safe_fopen(const char *pathname, const char *mode)
 {
     FILE *f;
@@ -159,6 +191,75 @@ uint16 *readUint16Block(FILE *f, int len)
 }
 
 
+uint8 *mapFileReadOnly(const char *pathname, uint32 *size)
+{
+    // Map a whole file read-only in memory, so that the caller can parse
+    // it in place. Returns NULL if the file can't be opened or mapped.
+
+    uint8 *data = NULL;
+
+#ifdef _WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER fileSize;
+
+    file = CreateFileA(pathname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (mapping != NULL) {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            *size = (uint32) fileSize.QuadPart;
+            CloseHandle(mapping);   // the view keeps the mapping alive
+        }
+    }
+
+    CloseHandle(file);
+#else
+    struct stat st;
+    int fd = open(pathname, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (!fstat(fd, &st) && st.st_size > 0) {
+
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data == MAP_FAILED)
+            data = NULL;
+        else
+            *size = (uint32) st.st_size;
+    }
+
+    close(fd);   // the mapping stays valid after close()
+#endif
+
+    return data;
+}
+
+
+void unmapFile(uint8 *data, uint32 size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+
+uint8 peekUint8(uint8 *data, uint32 *offset)
+{
+    return data[(*offset)++];
+}
+
+
 uint16 peekUint16(uint8 *data, uint32 *offset)
 {
     uint16 result;
@@ -170,6 +271,39 @@ uint16 peekUint16(uint8 *data, uint32 *offset)
 }
 
 
+uint32 peekUint32(uint8 *data, uint32 *offset)
+{
+    uint32 result;
+
+    result  = data[(*offset)++];
+    result |= data[(*offset)++] << 8;
+    result |= data[(*offset)++] << 16;
+    result |= (uint32) data[(*offset)++] << 24;
+
+    return result;
+}
+
+
+char *peekString(uint8 *data, uint32 *offset, int maxlen)
+{
+    // Returns a view on a zero-terminated string stored in data,
+    // and skips it - just like getString() does for files
+
+    char *result = (char *) data + *offset;
+    int len = 0;
+
+    while (len < maxlen && result[len] != 0)
+        len++;
+
+    if (len == maxlen)
+        fatalError("string longer than %d chars at offset %d", maxlen, *offset);
+
+    *offset += len + 1;
+
+    return result;
+}
+
+
 void peekUint16Block(uint8 *data, uint32 *offset, uint16 *dest, int len)
 {
     for (int i=0; i < len ; i++)
@@ -230,3 +364,48 @@ char *getMonthAndDay()
     return result;
 }
 
+
+
+uint32 getCpuFeatures()
+{
+    static int initialized = 0;
+    static uint32 features = 0;
+
+    if (initialized)
+        return features;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse2"))
+        features |= CPU_SSE2;
+    if (__builtin_cpu_supports("ssse3"))
+        features |= CPU_SSSE3;
+    if (__builtin_cpu_supports("avx2"))
+        features |= CPU_AVX2;
+
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+
+    __cpuid(info, 1);
+
+    if (info[3] & (1 << 26))
+        features |= CPU_SSE2;
+    if (info[2] & (1 << 9))
+        features |= CPU_SSSE3;
+
+    // AVX2 also needs the OS to save the ymm registers
+    if ((info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6) {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+            features |= CPU_AVX2;
+    }
+
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    features |= CPU_NEON;
+#endif
+
+    initialized = 1;
+
+    return features;
+}
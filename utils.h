@@ -25,11 +25,18 @@
 #include <stdio.h>
 #include <stdarg.h>
 
+#define CPU_SSE2    0x01
+#define CPU_SSSE3   0x02
+#define CPU_AVX2    0x04
+#define CPU_NEON    0x08
+
 extern int debugMode;
 
 void   fatalError(char *message, ... );
 void   debugMsg(char *message, ... );
 void   *safe_malloc(size_t size);
+void   *safe_realloc(void *ptr, size_t size);
+void   *safe_malloc_array(size_t count, size_t size);
 FILE   *safe_fopen(const char *pathname, const char *mode);
 uint8  readUint8(FILE *f);
 uint16 readUint16(FILE *f);
@@ -37,10 +44,16 @@ uint32 readUint32(FILE *f);
 char   *getString(FILE *f, int maxlen);
 uint8  *readUint8Block(FILE *f, int len);
 uint16 *readUint16Block(FILE *f, int len);
+uint8  *mapFileReadOnly(const char *pathname, uint32 *size);
+void   unmapFile(uint8 *data, uint32 size);
+uint8  peekUint8(uint8 *data, uint32 *offset);
 uint16 peekUint16(uint8 *data, uint32 *offset);
+uint32 peekUint32(uint8 *data, uint32 *offset);
+char   *peekString(uint8 *data, uint32 *offset, int maxlen);
 void   peekUint16Block(uint8 *data, uint32 *offset, uint16 *dest, int len);
 void   hexdump(uint8 *data, uint32 len);
 int    getDayOfYear(void);
 int    getHour(void);
 char   *getMonthAndDay(void);
+uint32 getCpuFeatures(void);
 